@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# End-to-end erase + write benchmark, run by "make bench-e2e".
+#
+# Writes a fixed pseudo-random image with the given flashtool to a file
+# backed NAND (--file-nand, in $BENCH_DIR, tmpfs by default) for each
+# layout, image size and bad block density, RUNS times each, and prints
+# one CSV line per case from the --stats summaries: best and median run
+# time, MB/s of the best run and where its time went.
+#
+# With BENCH_MTD=/dev/mtdX the writes go to that MTD device instead, e.g.
+# nandsim; its bad blocks are its own, so only density 0 is run.
+#
+#	bench_e2e.sh [flashtool]
+#
+# Environment: BENCH_SIZES (MiB), BENCH_BAD (percent of blocks bad),
+# BENCH_MODES (inband legacy dm365-rbl), RUNS, BENCH_DIR, BENCH_MTD.
+#
+# Copyright (C) 2011 Racelogic Limited
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License version 2
+# as published by the Free Software Foundation.
+
+FLASHTOOL=${1:-./flashtool}
+SIZES=${BENCH_SIZES:-"4 16 64"}
+BAD=${BENCH_BAD:-"0 1 5"}
+MODES=${BENCH_MODES:-"inband legacy"}
+RUNS=${RUNS:-5}
+if [ -z "$BENCH_DIR" ]; then
+	[ -d /dev/shm ] && BENCH_DIR=/dev/shm || BENCH_DIR=${TMPDIR:-/tmp}
+fi
+
+# 2048 + 64 byte pages, 64 pages per block
+PAGE=2048
+OOB=64
+PPB=64
+BLOCK_KB=$((PAGE * PPB / 1024))
+
+DIR=$(mktemp -d "$BENCH_DIR/bench_e2e.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+# $1 field of op $2 (or the top level with no $2) in a --stats summary $3
+stat() {
+	if [ -n "$2" ]; then
+		sed -n "s/.*\"$2\": {.*\"$1\": \([0-9.]*\).*/\1/p" "$3"
+	else
+		sed -n "s/^  \"$1\": \([0-9.]*\).*/\1/p" "$3"
+	fi
+}
+
+# a MiB of repeatable noise, the image is copies of it
+LC_ALL=C awk 'BEGIN { srand(1); for (i = 0; i < 1048576; i++)
+	printf "%c", int(rand() * 256) }' > "$DIR/chunk" || exit 1
+
+echo "mode,size_mb,bad_pct,bad_blocks,runs,elapsed_s,elapsed_s_median,mb_s,erase_s,program_s,ecc_wait_s,image_s"
+
+for size in $SIZES; do
+	: > "$DIR/img"
+	i=0
+	while [ $i -lt "$size" ]; do
+		cat "$DIR/chunk" >> "$DIR/img"
+		i=$((i + 1))
+	done
+	# twice the image, room for the bad blocks
+	blocks=$((size * 1024 / BLOCK_KB * 2))
+
+	for mode in $MODES; do
+		case $mode in
+		inband)	opts="" ;;
+		legacy)	opts="--legacy" ;;
+		dm365-rbl)	opts="--dm365-rbl" ;;
+		*)	echo "unknown mode $mode" >&2; exit 1 ;;
+		esac
+
+		for pct in $BAD; do
+			if [ -n "$BENCH_MTD" ] && [ "$pct" != 0 ]; then
+				continue
+			fi
+			# every (100 / pct)th block bad, the same ones every run
+			badlist=$(awk -v n="$blocks" -v p="$pct" 'BEGIN {
+				if (p > 0) for (b = int(100 / p) - 1; b < n; b += 100 / p)
+					printf "%s%d", s++ ? "," : "", b }')
+			nbad=$(echo "$badlist" | awk -F, '{ print $0 == "" ? 0 : NF }')
+
+			run=0
+			: > "$DIR/times"
+			while [ $run -lt "$RUNS" ]; do
+				rm -f "$DIR/nand"
+				if [ -n "$BENCH_MTD" ]; then
+					set -- "$BENCH_MTD"
+				else
+					set -- --file-nand "$PAGE:$OOB:$PPB:$blocks" "$DIR/nand"
+					[ -n "$badlist" ] && set -- --badblocks "$badlist" "$@"
+				fi
+				if ! "$FLASHTOOL" -q -e -w -s 0 $opts \
+						--stats "$DIR/stats.$run" "$@" "$DIR/img" \
+						> /dev/null 2> "$DIR/err"; then
+					cat "$DIR/err" >&2
+					exit 1
+				fi
+				echo "$(stat elapsed_s "" "$DIR/stats.$run") $run" \
+					>> "$DIR/times"
+				run=$((run + 1))
+			done
+
+			best=$(sort -n "$DIR/times" | head -n 1 | cut -d' ' -f2)
+			median=$(sort -n "$DIR/times" | sed -n "$(((RUNS + 1) / 2))p" |
+				cut -d' ' -f1)
+			s="$DIR/stats.$best"
+			el=$(stat elapsed_s "" "$s")
+			echo "$mode,$size,$pct,$nbad,$RUNS,$el,$median,$(awk \
+				-v b="$(stat bytes "" "$s")" -v t="$el" \
+				'BEGIN { printf "%.1f", b / t / 1e6 }'),$(stat total_s erase \
+				"$s"),$(stat total_s program "$s"),$(stat total_s ecc_wait \
+				"$s"),$(stat total_s image "$s")"
+		done
+	done
+done
@@ -0,0 +1,225 @@
+/*
+ * ECC generation microbenchmark, built for the host by "make bench-ecc".
+ * Times gen_subpage_ecc(), do_genecc() and genecc_block() for each parity
+ * backend, layout and page geometry on fixed pseudo-random data, and
+ * prints one CSV line per case.
+ *
+ * Each case is run for TRIALS trials of at least TRIAL_NS; the best trial
+ * gives MB/s and cycles/byte and the median is there to show the noise.
+ * Cycles are CPU cycles from perf events where allowed, else the x86 TSC
+ * (reference cycles), else left empty.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#endif
+
+#include "genecc.h"
+
+#define TRIALS		7
+#define TRIAL_NS	50000000ULL		// 50 ms
+#define BLOCK_PAGES	64
+
+enum bench_func { FUNC_SUBPAGE, FUNC_PAGE, FUNC_BLOCK };
+
+static const char *const func_names[] = { "subpage", "page", "block" };
+static const char *const backends[] = { "scalar", "ssse3", "avx2", "neon" };
+
+static const struct {
+	int		data;
+	int		oob;
+} geometries[] = {
+	{ 2048, 64 },
+	{ 4096, 128 },
+	{ 4096, 224 },
+	{ 512, 16 },
+};
+
+static u8				*src, *raw;
+static int				perf_fd = -1;
+static const char		*cycle_src = "";
+
+static unsigned long long now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* Pick the cycle counter: perf CPU cycles, the TSC, or none */
+static void cycles_init(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+		cycle_src = "perf";
+		return;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	cycle_src = "tsc";
+#endif
+}
+
+/* Cycle count, 0 if there is no counter */
+static unsigned long long cycles(void)
+{
+	unsigned long long c;
+
+	if (perf_fd >= 0)
+		return read(perf_fd, &c, sizeof(c)) == sizeof(c) ? c : 0;
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* One pass over the block of test data */
+static void run_once(enum bench_func func, int layout)
+{
+	int i, nsub;
+
+	switch (func) {
+	case FUNC_SUBPAGE:
+		nsub = BLOCK_PAGES * genecc_page_data / GENECC_SUBPAGE_DATA;
+		for (i = 0; i < nsub; i++)
+			gen_subpage_ecc(&src[i * GENECC_SUBPAGE_DATA], &raw[i * 10]);
+		break;
+	case FUNC_PAGE:
+		for (i = 0; i < BLOCK_PAGES; i++)
+			do_genecc(&src[i * genecc_page_data], &raw[i * genecc_page_raw],
+					layout);
+		break;
+	case FUNC_BLOCK:
+		genecc_block(src, raw, BLOCK_PAGES, layout);
+		break;
+	}
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench(enum bench_func func, const char *backend, int layout)
+{
+	double mbs[TRIALS], best_cpb = 0, best = 0;
+	unsigned long long t0, t1, c0, c1, bytes;
+	int trial, reps, r;
+
+	bytes = (unsigned long long)BLOCK_PAGES * genecc_page_data;
+
+	// warm up, and size the trials
+	t0 = now_ns();
+	run_once(func, layout);
+	t1 = now_ns();
+	reps = TRIAL_NS / (t1 - t0 + 1) + 1;
+
+	for (trial = 0; trial < TRIALS; trial++) {
+		c0 = cycles();
+		t0 = now_ns();
+		for (r = 0; r < reps; r++)
+			run_once(func, layout);
+		t1 = now_ns();
+		c1 = cycles();
+
+		mbs[trial] = bytes * reps / ((t1 - t0) / 1e9) / 1e6;
+		if (mbs[trial] > best) {
+			best = mbs[trial];
+			best_cpb = c1 > c0 ? (double)(c1 - c0) / (bytes * reps) : 0;
+		}
+	}
+	qsort(mbs, TRIALS, sizeof(mbs[0]), cmp_double);
+
+	printf("%s,%s,%s,%d,%d,%.1f,%.1f,", func_names[func], backend,
+			func == FUNC_SUBPAGE ? "-" :
+			layout == GENECC_LAYOUT_LEGACY ? "legacy" : "dm365-rbl",
+			genecc_page_data, genecc_page_raw - genecc_page_data,
+			best, mbs[TRIALS / 2]);
+	if (best_cpb > 0)
+		printf("%.3f,%s\n", best_cpb, cycle_src);
+	else
+		printf(",\n");
+	fflush(stdout);
+}
+
+int main(void)
+{
+	static const int layouts[] = {
+		GENECC_LAYOUT_LEGACY, GENECC_LAYOUT_DM365_RBL
+	};
+	unsigned int seed = 12345, g, b;
+	int l, i;
+
+	genecc_init();
+	if (genecc_selftest() < 0) {
+		fprintf(stderr, "ECC selftest failed\n");
+		return 1;
+	}
+	cycles_init();
+
+	// big enough for the largest geometry
+	src = malloc(BLOCK_PAGES * 4096);
+	raw = malloc(BLOCK_PAGES * (4096 + 224));
+	if (!src || !raw) {
+		fprintf(stderr, "malloc failed\n");
+		return 1;
+	}
+	for (i = 0; i < BLOCK_PAGES * 4096; i++) {
+		seed = seed * 1103515245 + 12345;
+		src[i] = seed >> 16;
+	}
+
+	printf("func,backend,layout,page,oob,mb_s,mb_s_median,cycles_per_byte,"
+			"cycle_src\n");
+
+	// the single subpage encoder is scalar whatever the backend
+	genecc_set_geometry(2048, 64);
+	bench(FUNC_SUBPAGE, "scalar", 0);
+
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+		if (genecc_set_backend(backends[b]) < 0)
+			continue;
+		for (g = 0; g < sizeof(geometries) / sizeof(geometries[0]); g++) {
+			genecc_set_geometry(geometries[g].data, geometries[g].oob);
+			for (l = 0; l < 2; l++) {
+				bench(FUNC_BLOCK, backends[b], layouts[l]);
+				bench(FUNC_PAGE, backends[b], layouts[l]);
+			}
+		}
+	}
+
+	free(src);
+	free(raw);
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * ECC encoder check, built for the host and run by "make check-ecc".
+ * Runs the golden vectors of genecc_selftest(), then compares the
+ * table-driven subpage encoder against gen_subpage_ecc_ref(), the original
+ * multiply()/modulo() long division, on SUBPAGES pseudo-random subpages,
+ * and genecc_block() with every parity backend this CPU supports, for both
+ * layouts and the common geometries, against pages laid out by hand with
+ * the reference parity. Then, with each backend, layout and geometry, the
+ * decoder behind --verify, genecc_check(): 1 to 4 random symbol errors in
+ * a subpage's data and parity must be corrected exactly, with the bits
+ * flipped reported; 5 to 8 must be reported uncorrectable or leave the
+ * page different from what was written, which the compare in --verify
+ * catches. Prints the first few mismatches and exits 1 if there are any.
+ *
+ *	check_ecc [seed]
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "genecc.h"
+
+#define SUBPAGES	20000
+#define BLOCKS		12			// per backend, layout and geometry
+#define BLOCK_PAGES	64
+#define DECODES		200			// per backend, layout and geometry
+#define DECODE_PAGES	4
+#define MAX_SYMBOLS		8			// errors injected, S = 4 correctable
+#define MAX_REPORT	10
+
+static const char *const backends[] = { "scalar", "ssse3", "avx2", "neon" };
+
+static const struct {
+	int		data;
+	int		oob;
+} geometries[] = {
+	{ 2048, 64 },
+	{ 4096, 128 },
+	{ 4096, 224 },
+	{ 512, 16 },
+};
+
+static unsigned int	seed = 1;
+static int			mismatches;
+
+static u8 rnd(void)
+{
+	seed = seed * 1103515245u + 12345u;
+	return seed >> 16;
+}
+
+/*
+ * Fill a subpage. Mostly noise, with some mostly-FF (erased) and sparse
+ * ones mixed in, as an image has.
+ */
+static void fill_subpage(u8 *buf, int n)
+{
+	int i;
+
+	switch (n % 4) {
+	case 0:
+		memset(buf, 0xff, GENECC_SUBPAGE_DATA);
+		buf[rnd() % GENECC_SUBPAGE_DATA] = rnd();
+		break;
+	case 1:
+		memset(buf, 0, GENECC_SUBPAGE_DATA);
+		for (i = rnd() % 16; i > 0; i--)
+			buf[(rnd() << 8 | rnd()) % GENECC_SUBPAGE_DATA] = rnd();
+		break;
+	default:
+		for (i = 0; i < GENECC_SUBPAGE_DATA; i++)
+			buf[i] = rnd();
+		break;
+	}
+}
+
+static void mismatch(const char *what, int n, const u8 *got, const u8 *want)
+{
+	int i;
+
+	if (mismatches++ >= MAX_REPORT)
+		return;
+	fprintf(stderr, "%s: subpage %d mismatch, got", what, n);
+	for (i = 0; i < 10; i++)
+		fprintf(stderr, " %02x", got[i]);
+	fprintf(stderr, ", want");
+	for (i = 0; i < 10; i++)
+		fprintf(stderr, " %02x", want[i]);
+	fprintf(stderr, "\n");
+}
+
+/* gen_subpage_ecc() against the reference, one subpage at a time */
+static void check_subpages(void)
+{
+	u8 buf[GENECC_SUBPAGE_DATA], ecc[10], ecc_ref[10];
+	int n;
+
+	for (n = 0; n < SUBPAGES; n++) {
+		fill_subpage(buf, n);
+		gen_subpage_ecc(buf, ecc);
+		gen_subpage_ecc_ref(buf, ecc_ref);
+		if (memcmp(ecc, ecc_ref, 10))
+			mismatch("subpage", n, ecc, ecc_ref);
+	}
+	printf("subpage: %d subpages checked\n", SUBPAGES);
+}
+
+/* Lay out npages pages of src in raw as genecc_block() should */
+static void ref_block(const u8 *src, u8 *raw, int npages, int layout)
+{
+	int nsub = genecc_page_data / GENECC_SUBPAGE_DATA;
+	int p, n;
+	u8 *sub;
+
+	memset(raw, 0xff, (size_t)npages * genecc_page_raw);
+	for (p = 0; p < npages; p++) {
+		for (n = 0; n < nsub; n++) {
+			if (layout == GENECC_LAYOUT_LEGACY) {
+				sub = raw + n * (GENECC_SUBPAGE_DATA + GENECC_SUBPAGE_OOB);
+				memcpy(sub, src + n * GENECC_SUBPAGE_DATA,
+						GENECC_SUBPAGE_DATA);
+				gen_subpage_ecc_ref(sub, sub + GENECC_SUBPAGE_DATA + 6);
+			} else {
+				memcpy(raw + n * GENECC_SUBPAGE_DATA,
+						src + n * GENECC_SUBPAGE_DATA, GENECC_SUBPAGE_DATA);
+				gen_subpage_ecc_ref(raw + n * GENECC_SUBPAGE_DATA,
+						raw + genecc_page_data + n * GENECC_SUBPAGE_OOB + 6);
+			}
+		}
+		src += genecc_page_data;
+		raw += genecc_page_raw;
+	}
+}
+
+/*
+ * genecc_block() against ref_block() for one backend, layout and the
+ * current geometry, on blocks of 1 to BLOCK_PAGES pages so the part-filled
+ * lane sets at the end of a block are covered too.
+ */
+static void check_blocks(const char *backend, int layout, u8 *src, u8 *raw,
+		u8 *ref)
+{
+	char what[64];
+	int b, i, n, npages;
+
+	snprintf(what, sizeof(what), "%s %s %d+%d", backend,
+			layout == GENECC_LAYOUT_LEGACY ? "legacy" : "dm365-rbl",
+			genecc_page_data, genecc_page_raw - genecc_page_data);
+
+	for (b = 0; b < BLOCKS; b++) {
+		// the last block full size
+		npages = b == BLOCKS - 1 ? BLOCK_PAGES : (rnd() % BLOCK_PAGES) + 1;
+		for (n = 0; n * GENECC_SUBPAGE_DATA < npages * genecc_page_data; n++)
+			fill_subpage(&src[n * GENECC_SUBPAGE_DATA], rnd());
+		// stale bytes in raw must not survive into the output
+		for (i = 0; i < npages * genecc_page_raw; i++)
+			raw[i] = rnd();
+
+		genecc_block(src, raw, npages, layout);
+		ref_block(src, ref, npages, layout);
+		if (memcmp(raw, ref, (size_t)npages * genecc_page_raw) == 0)
+			continue;
+		for (i = 0; raw[i] == ref[i]; i++)
+			;
+		if (mismatches++ < MAX_REPORT)
+			fprintf(stderr, "%s: block %d (%d pages) mismatch at page %d "
+					"byte %d\n", what, b, npages, i / genecc_page_raw,
+					i % genecc_page_raw);
+	}
+	printf("%s: %d blocks checked\n", what, BLOCKS);
+}
+
+/* Where subpage n of the raw page at page keeps its data and ECC */
+static void subpage_at(u8 *page, int n, int layout, u8 **data, u8 **ecc)
+{
+	if (layout == GENECC_LAYOUT_LEGACY) {
+		*data = page + n * (GENECC_SUBPAGE_DATA + GENECC_SUBPAGE_OOB);
+		*ecc = *data + GENECC_SUBPAGE_DATA + 6;
+	} else {
+		*data = page + n * GENECC_SUBPAGE_DATA;
+		*ecc = page + genecc_page_data + n * GENECC_SUBPAGE_OOB + 6;
+	}
+}
+
+static int bits(unsigned int x)
+{
+	int n = 0;
+
+	for (; x; x &= x - 1)
+		n++;
+	return n;
+}
+
+/*
+ * Corrupt nerr distinct symbols of a subpage: of the 520, 512 are data
+ * bytes and 8 are the 10-bit parity symbols, packed LSB first in the 10
+ * ECC bytes. With parity set the first one is always a parity symbol, as
+ * few would be otherwise. Returns the number of bits flipped.
+ */
+static int inject(u8 *data, u8 *ecc, int nerr, int parity)
+{
+	int pos[MAX_SYMBOLS];
+	unsigned int mask;
+	int i, j, b, flipped = 0;
+
+	for (i = 0; i < nerr; i++) {
+		do {
+			if (i == 0 && parity)
+				pos[i] = GENECC_SUBPAGE_DATA + rnd() % 8;
+			else
+				pos[i] = (rnd() << 8 | rnd()) % (GENECC_SUBPAGE_DATA + 8);
+			for (j = 0; j < i && pos[j] != pos[i]; j++)
+				;
+		} while (j < i);
+
+		if (pos[i] < GENECC_SUBPAGE_DATA) {
+			while (!(mask = rnd()))
+				;
+			data[pos[i]] ^= mask;
+		} else {
+			while (!(mask = (rnd() << 8 | rnd()) & 0x3ff))
+				;
+			for (b = 0; b < 10; b++) {
+				j = (pos[i] - GENECC_SUBPAGE_DATA) * 10 + b;
+				if (mask & (1 << b))
+					ecc[j / 8] ^= 1 << (j % 8);
+			}
+		}
+		flipped += bits(mask);
+	}
+	return flipped;
+}
+
+/*
+ * genecc_check() on good pages with 0 to MAX_SYMBOLS symbol errors in one
+ * subpage, for one backend, layout and the current geometry.
+ */
+static void check_decode(const char *backend, int layout, u8 *src, u8 *raw,
+		u8 *ref)
+{
+	int flips[GENECC_BATCH_SUBPAGES];
+	int nsub = genecc_page_data / GENECC_SUBPAGE_DATA;
+	int t, i, n, p, nerr, flipped, ret, bad, failed = 0, miscorrected = 0;
+	u8 *page, *data, *ecc;
+	char what[64];
+
+	snprintf(what, sizeof(what), "decode %s %s %d+%d", backend,
+			layout == GENECC_LAYOUT_LEGACY ? "legacy" : "dm365-rbl",
+			genecc_page_data, genecc_page_raw - genecc_page_data);
+
+	for (t = 0; t < DECODES; t++) {
+		if (t % 50 == 0) {
+			for (n = 0; n < DECODE_PAGES * nsub; n++)
+				fill_subpage(&src[n * GENECC_SUBPAGE_DATA], rnd());
+			genecc_block(src, ref, DECODE_PAGES, layout);
+		}
+		memcpy(raw, ref, (size_t)DECODE_PAGES * genecc_page_raw);
+
+		nerr = t % (MAX_SYMBOLS + 1);
+		p = rnd() % DECODE_PAGES;
+		n = rnd() % nsub;
+		page = raw + p * genecc_page_raw;
+		subpage_at(page, n, layout, &data, &ecc);
+		flipped = inject(data, ecc, nerr, t / (MAX_SYMBOLS + 1) % 2);
+
+		ret = genecc_check(page, 1, layout, flips);
+		bad = 0;
+		if (nerr <= MAX_SYMBOLS / 2) {
+			// corrected exactly, the count right, other subpages clean
+			for (i = 0; i < nsub; i++)
+				if (flips[i] != (i == n ? flipped : 0))
+					bad = 1;
+			if (ret != flipped || memcmp(raw, ref,
+						(size_t)DECODE_PAGES * genecc_page_raw))
+				bad = 1;
+		} else if (ret < 0) {
+			failed++;
+		} else if (memcmp(raw, ref, (size_t)DECODE_PAGES * genecc_page_raw)) {
+			// decoded to another codeword, --verify's compare sees it
+			miscorrected++;
+		} else {
+			// 5+ errors can not decode to what was written
+			bad = 1;
+		}
+		if (bad && mismatches++ < MAX_REPORT)
+			fprintf(stderr, "%s: %d symbol errors (%d bits) in page %d "
+					"subpage %d: got %d, %d bits\n", what, nerr, flipped, p,
+					n, ret, flips[n]);
+	}
+	printf("%s: %d decodes checked, of the 5+ error ones %d uncorrectable, "
+			"%d miscorrected\n", what, DECODES, failed, miscorrected);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int layouts[] = {
+		GENECC_LAYOUT_LEGACY, GENECC_LAYOUT_DM365_RBL
+	};
+	unsigned int b, g;
+	u8 *src, *raw, *ref;
+	int l;
+
+	if (argc > 1)
+		seed = strtoul(argv[1], NULL, 0);
+	printf("seed %u\n", seed);
+
+	genecc_init();
+	if (genecc_selftest() < 0)
+		mismatches++;
+	check_subpages();
+
+	// big enough for the largest geometry
+	src = malloc(BLOCK_PAGES * 4096);	// DECODE_PAGES fit too
+	raw = malloc(BLOCK_PAGES * (4096 + 224));
+	ref = malloc(BLOCK_PAGES * (4096 + 224));
+	if (!src || !raw || !ref) {
+		fprintf(stderr, "malloc failed\n");
+		return 1;
+	}
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+		if (genecc_set_backend(backends[b]) < 0) {
+			printf("%s: not supported here, skipped\n", backends[b]);
+			continue;
+		}
+		for (g = 0; g < sizeof(geometries) / sizeof(geometries[0]); g++) {
+			genecc_set_geometry(geometries[g].data, geometries[g].oob);
+			for (l = 0; l < 2; l++) {
+				check_blocks(backends[b], layouts[l], src, raw, ref);
+				check_decode(backends[b], layouts[l], src, raw, ref);
+			}
+		}
+	}
+	free(src);
+	free(raw);
+	free(ref);
+
+	if (mismatches) {
+		fprintf(stderr, "%d ECC mismatches\n", mismatches);
+		return 1;
+	}
+	printf("ECC check passed\n");
+	return 0;
+}
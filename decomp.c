@@ -0,0 +1,314 @@
+/*
+ * Image decompression: gzip, zstd or lz4 streams decoded as the image
+ * reader asks for data, so a compressed image never has to be unpacked to
+ * a file first. decomp_read() stands in for read(2) in the reader thread,
+ * which keeps decoding overlapped with erase and program.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#  include <lz4frame.h>
+#endif
+
+#include "debug.h"
+#include "decomp.h"
+#include "monotime.h"
+
+// compressed bytes per read() from the image
+#define DECOMP_INBUF		(64 * 1024)
+
+enum {
+	FMT_GZIP = 1,
+	FMT_ZSTD,
+	FMT_LZ4,
+};
+
+static int				fmt;
+static unsigned char	*inbuf;
+static size_t			in_pos, in_len;
+static int				in_eof;
+static int				frame_done;		// decoder is between frames
+static unsigned long long read_ns, decode_ns;
+
+#ifdef HAVE_ZLIB
+static z_stream			zs;
+#endif
+#ifdef HAVE_ZSTD
+static ZSTD_DCtx		*zds;
+#endif
+#ifdef HAVE_LZ4
+static LZ4F_dctx		*lz4;
+#endif
+
+/* Append compressed data to inbuf. Returns bytes read, 0 at EOF, or -1. */
+static ssize_t fill(int fd)
+{
+	unsigned long long t0;
+	ssize_t ret;
+
+	if (in_pos == in_len)
+		in_pos = in_len = 0;
+
+	t0 = monotime_ns();
+	do {
+		ret = read(fd, inbuf + in_len, DECOMP_INBUF - in_len);
+	} while (ret < 0 && errno == EINTR);
+	read_ns += monotime_ns() - t0;
+
+	if (ret < 0) {
+		perror("Reading compressed image");
+		return -1;
+	}
+	if (ret == 0)
+		in_eof = 1;
+	in_len += ret;
+	return ret;
+}
+
+/*
+ * Run the decoder once over what is in inbuf into out. Returns the number
+ * of bytes produced, or -1.
+ */
+static ssize_t decode(unsigned char *out, size_t len)
+{
+	size_t in_before = in_pos;
+	size_t produced = 0;
+	int end = 0;
+
+	switch (fmt) {
+#ifdef HAVE_ZLIB
+	case FMT_GZIP: {
+		int ret;
+
+		zs.next_in = inbuf + in_pos;
+		zs.avail_in = in_len - in_pos;
+		zs.next_out = out;
+		zs.avail_out = len;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		in_pos = in_len - zs.avail_in;
+		produced = len - zs.avail_out;
+		if (ret == Z_STREAM_END) {
+			// there may be another member after this one
+			end = 1;
+			inflateReset(&zs);
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			fprintf(stderr, "gzip: %s\n", zs.msg ? zs.msg : "bad data");
+			return -1;
+		}
+		break;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case FMT_ZSTD: {
+		ZSTD_inBuffer in = { inbuf, in_len, in_pos };
+		ZSTD_outBuffer o = { out, len, 0 };
+		size_t ret;
+
+		ret = ZSTD_decompressStream(zds, &o, &in);
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(ret));
+			return -1;
+		}
+		in_pos = in.pos;
+		produced = o.pos;
+		end = ret == 0;
+		break;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case FMT_LZ4: {
+		size_t dst = len, src = in_len - in_pos;
+		size_t ret;
+
+		ret = LZ4F_decompress(lz4, out, &dst, inbuf + in_pos, &src, NULL);
+		if (LZ4F_isError(ret)) {
+			fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(ret));
+			return -1;
+		}
+		in_pos += src;
+		produced = dst;
+		end = ret == 0;
+		break;
+	}
+#endif
+	default:
+		ERR("BUG: bad format %d\n", fmt);
+		return -1;
+	}
+
+	if (end)
+		frame_done = 1;
+	else if (produced || in_pos != in_before)
+		frame_done = 0;
+	return produced;
+}
+
+/*
+ * read(2) of decompressed image data, for imgread_set_read(). Returns len
+ * bytes except at the end of the image, 0 at the end, or -1.
+ */
+ssize_t decomp_read(int fd, void *buf, size_t len)
+{
+	unsigned long long t0;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		if (in_pos == in_len && !in_eof && fill(fd) < 0)
+			return -1;
+
+		t0 = monotime_ns();
+		n = decode((unsigned char *)buf + done, len - done);
+		decode_ns += monotime_ns() - t0;
+		if (n < 0)
+			return -1;
+		done += n;
+
+		// nothing more in the decoder and nothing more to give it
+		if (n == 0 && in_pos == in_len && in_eof) {
+			if (!frame_done) {
+				fprintf(stderr, "Compressed image is truncated\n");
+				return -1;
+			}
+			break;
+		}
+	}
+	return done;
+}
+
+/*
+ * Set up to decode the image on fd, format "gzip", "zstd", "lz4", or
+ * "auto" to go by the magic number. Returns 0 or -1.
+ */
+int decomp_open(int fd, const char *format)
+{
+	static const unsigned char gz_magic[] = { 0x1f, 0x8b };
+	static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+	static const unsigned char lz4_magic[] = { 0x04, 0x22, 0x4d, 0x18 };
+
+	inbuf = malloc(DECOMP_INBUF);
+	if (!inbuf) {
+		ERR("malloc failed\n");
+		return -1;
+	}
+	in_pos = in_len = 0;
+	in_eof = frame_done = 0;
+
+	// enough for the magic number, it stays in inbuf for the decoder
+	while (in_len < sizeof(zstd_magic) && !in_eof)
+		if (fill(fd) < 0)
+			return -1;
+
+	if (!strcmp(format, "gzip")) {
+		fmt = FMT_GZIP;
+	} else if (!strcmp(format, "zstd")) {
+		fmt = FMT_ZSTD;
+	} else if (!strcmp(format, "lz4")) {
+		fmt = FMT_LZ4;
+	} else if (!strcmp(format, "auto")) {
+		if (in_len >= 2 && !memcmp(inbuf, gz_magic, 2))
+			fmt = FMT_GZIP;
+		else if (in_len >= 4 && !memcmp(inbuf, zstd_magic, 4))
+			fmt = FMT_ZSTD;
+		else if (in_len >= 4 && !memcmp(inbuf, lz4_magic, 4))
+			fmt = FMT_LZ4;
+		else {
+			fprintf(stderr, "Image is not gzip, zstd or lz4\n");
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "Unknown compression \"%s\"\n", format);
+		return -1;
+	}
+
+	switch (fmt) {
+#ifdef HAVE_ZLIB
+	case FMT_GZIP:
+		memset(&zs, 0, sizeof(zs));
+		// 32: gzip or zlib header
+		if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+			ERR("inflateInit2 failed\n");
+			return -1;
+		}
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case FMT_ZSTD:
+		zds = ZSTD_createDCtx();
+		if (!zds) {
+			ERR("ZSTD_createDCtx failed\n");
+			return -1;
+		}
+		break;
+#endif
+#ifdef HAVE_LZ4
+	case FMT_LZ4:
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&lz4,
+						LZ4F_VERSION))) {
+			ERR("LZ4F_createDecompressionContext failed\n");
+			return -1;
+		}
+		break;
+#endif
+	default:
+		fprintf(stderr, "%s decompression not built in\n",
+				fmt == FMT_GZIP ? "gzip" : fmt == FMT_ZSTD ? "zstd" : "lz4");
+		return -1;
+	}
+	DBG("format %d\n", fmt);
+	return 0;
+}
+
+void decomp_close(void)
+{
+	switch (fmt) {
+#ifdef HAVE_ZLIB
+	case FMT_GZIP:
+		inflateEnd(&zs);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case FMT_ZSTD:
+		ZSTD_freeDCtx(zds);
+		zds = NULL;
+		break;
+#endif
+#ifdef HAVE_LZ4
+	case FMT_LZ4:
+		LZ4F_freeDecompressionContext(lz4);
+		lz4 = NULL;
+		break;
+#endif
+	}
+	fmt = 0;
+	free(inbuf);
+	inbuf = NULL;
+}
+
+/* Seconds spent reading compressed data and decoding it */
+void decomp_times(double *read_s, double *decode_s)
+{
+	*read_s = read_ns / 1e9;
+	*decode_s = decode_ns / 1e9;
+}
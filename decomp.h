@@ -0,0 +1,11 @@
+#ifndef DECOMP_H
+#define DECOMP_H
+
+#include <sys/types.h>
+
+int decomp_open(int fd, const char *format);
+ssize_t decomp_read(int fd, void *buf, size_t len);
+void decomp_close(void);
+void decomp_times(double *read_s, double *decode_s);
+
+#endif // DECOMP_H
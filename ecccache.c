@@ -0,0 +1,280 @@
+/*
+ * ECC page cache for --ecc-cache. Flashing the same image again, e.g. a
+ * UBL on every board of a production run, finds its raw data + OOB pages
+ * in a file named by a hash of the image data, layout and geometry and
+ * maps it instead of generating ECC. The header repeats the key and holds
+ * a hash of the pages, checked before an entry is used; anything that
+ * does not match is treated as a miss and the entry built again.
+ *
+ * A new entry is built in a temporary file alongside and renamed into
+ * place only once every page is in it, so a failed run leaves no entry.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "ecccache.h"
+
+#define CACHE_MAGIC		"FTECC\0\0\0"
+#define CACHE_HDR_SIZE	4096		// keeps the pages page aligned
+
+struct cache_hdr {
+	char		magic[8];
+	uint32_t	version;			// ECCCACHE_VERSION
+	uint32_t	layout;
+	uint32_t	page_data;
+	uint32_t	page_raw;
+	uint64_t	len;				// image bytes
+	uint64_t	npages;
+	uint64_t	key[2];				// hash of the image, as in the name
+	uint64_t	sum;				// hash of the pages
+};
+
+static char				path[PATH_MAX];
+static char				tmp_path[PATH_MAX];
+static int				cache_fd = -1;
+static unsigned char	*map;
+static size_t			map_size;
+static int				building;		// map is a new entry in tmp_path
+static struct cache_hdr	want;
+static long long		pages_put;
+
+/*
+ * Hashing, xxh64 style: four independent 64-bit lanes over 32 byte
+ * stripes, so it runs well ahead of the RS encoder. Not cryptographic,
+ * the cache is only ever fed by the tool itself.
+ */
+#define P1	0x9e3779b185ebca87ULL
+#define P2	0xc2b2ae3d27d4eb4fULL
+#define P3	0x165667b19e3779f9ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t w)
+{
+	return rotl(acc + w * P2, 31) * P1;
+}
+
+static uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	return h ^ (h >> 32);
+}
+
+/* 128 bits of hash of len bytes at p, two differently merged lanes */
+static void hash128(const unsigned char *p, long long len, uint64_t seed,
+		uint64_t out[2])
+{
+	uint64_t v[4] = { seed + P1 + P2, seed + P2, seed, seed - P1 };
+	unsigned char tail[32];
+	uint64_t w, h0, h1;
+	long long i;
+	int l;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		for (l = 0; l < 4; l++) {
+			memcpy(&w, p + i + 8 * l, 8);
+			v[l] = hash_round(v[l], w);
+		}
+	}
+	// the tail zero padded, always a stripe so the length counts
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, p + i, len - i);
+	for (l = 0; l < 4; l++) {
+		memcpy(&w, tail + 8 * l, 8);
+		v[l] = hash_round(v[l], w);
+	}
+
+	h0 = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+	h1 = hash_round(hash_round(hash_round(hash_round(len, v[0]), v[1]),
+				v[2]), v[3]);
+	out[0] = avalanche(h0 + len);
+	out[1] = avalanche(h1 ^ P3);
+}
+
+static uint64_t pages_sum(void)
+{
+	uint64_t h[2];
+
+	hash128(map + CACHE_HDR_SIZE, want.npages * want.page_raw, 0, h);
+	return h[0];
+}
+
+static void unmap(void)
+{
+	if (map) {
+		munmap(map, map_size);
+		map = NULL;
+	}
+	if (cache_fd >= 0) {
+		close(cache_fd);
+		cache_fd = -1;
+	}
+}
+
+/* Map the entry at path if it is the one wanted, intact. Returns 0 or -1. */
+static int map_entry(void)
+{
+	const struct cache_hdr *hdr;
+	struct stat st;
+
+	cache_fd = open(path, O_RDONLY);
+	if (cache_fd < 0)
+		return -1;
+	if (fstat(cache_fd, &st) != 0 || st.st_size != (off_t)map_size)
+		goto stale;
+	map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, cache_fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		goto stale;
+	}
+	hdr = (const struct cache_hdr *)map;
+	if (memcmp(hdr, &want, offsetof(struct cache_hdr, sum)) != 0 ||
+			hdr->sum != pages_sum())
+		goto stale;
+	// the pages are read once, in order, by the writer
+	madvise(map + CACHE_HDR_SIZE, map_size - CACHE_HDR_SIZE,
+			MADV_SEQUENTIAL);
+	return 0;
+
+stale:
+	fprintf(stderr, "ECC cache entry %s is stale, regenerating\n", path);
+	unmap();
+	return -1;
+}
+
+/* Start a new entry in a temporary file next to path. Returns 0 or -1. */
+static int build_entry(const char *dir, const char *name)
+{
+	snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.XXXXXX", dir, name);
+	cache_fd = mkstemp(tmp_path);
+	if (cache_fd < 0) {
+		perror(tmp_path);
+		return -1;
+	}
+	// mkstemp() makes it private, entries are for every user of the cache
+	if (fchmod(cache_fd, 0644) != 0 || ftruncate(cache_fd, map_size) != 0) {
+		perror(tmp_path);
+		goto fail;
+	}
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			cache_fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		perror(tmp_path);
+		goto fail;
+	}
+	building = 1;
+	pages_put = 0;
+	return 0;
+
+fail:
+	unmap();
+	unlink(tmp_path);
+	return -1;
+}
+
+/*
+ * Look up len bytes of image in the cache in dir. Returns 1 if its pages
+ * are there (see ecccache_pages()), 0 if not and a new entry is being
+ * built (see ecccache_put()), or -1 if the cache can not be used.
+ */
+int ecccache_open(const char *dir, const unsigned char *image,
+		long long len, int layout, int page_data, int page_raw)
+{
+	char name[40];
+
+	memset(&want, 0, sizeof(want));
+	memcpy(want.magic, CACHE_MAGIC, sizeof(want.magic));
+	want.version = ECCCACHE_VERSION;
+	want.layout = layout;
+	want.page_data = page_data;
+	want.page_raw = page_raw;
+	want.len = len;
+	want.npages = (len + page_data - 1) / page_data;
+	hash128(image, len, ((uint64_t)ECCCACHE_VERSION << 48) ^
+			((uint64_t)layout << 40) ^ ((uint64_t)page_data << 20) ^
+			page_raw, want.key);
+
+	snprintf(name, sizeof(name), "%016llx%016llx",
+			(unsigned long long)want.key[0], (unsigned long long)want.key[1]);
+	snprintf(path, sizeof(path), "%s/%s.ecc", dir, name);
+	map_size = CACHE_HDR_SIZE + want.npages * page_raw;
+	DBG("ECC cache entry %s\n", path);
+
+	if (map_entry() == 0)
+		return 1;
+	return build_entry(dir, name) == 0 ? 0 : -1;
+}
+
+/* Cache hit: the image's raw pages, in order, mapped read-only */
+const unsigned char *ecccache_pages(void)
+{
+	return map && !building ? map + CACHE_HDR_SIZE : NULL;
+}
+
+/* Building: store npages raw pages from image page first on */
+void ecccache_put(long long first, const unsigned char *raw, int npages)
+{
+	if (!building || first < 0 || first + npages > (long long)want.npages)
+		return;
+	memcpy(map + CACHE_HDR_SIZE + first * want.page_raw, raw,
+			(size_t)npages * want.page_raw);
+	pages_put += npages;
+}
+
+/*
+ * Building: with every page put, seal the entry and move it into place.
+ * Returns 0, or -1 if it is incomplete or could not be written.
+ */
+int ecccache_commit(void)
+{
+	if (!building || pages_put != (long long)want.npages)
+		return -1;
+
+	want.sum = pages_sum();
+	memcpy(map, &want, sizeof(want));
+	if (msync(map, map_size, MS_SYNC) != 0 || fsync(cache_fd) != 0 ||
+			rename(tmp_path, path) != 0) {
+		perror(path);
+		return -1;
+	}
+	building = 0;
+	unmap();
+	return 0;
+}
+
+/* Unmap, dropping an entry that was not committed. Safe to call twice. */
+void ecccache_close(void)
+{
+	unmap();
+	if (building) {
+		unlink(tmp_path);
+		building = 0;
+	}
+}
@@ -0,0 +1,18 @@
+#ifndef ECCCACHE_H
+#define ECCCACHE_H
+
+/*
+ * Persistent cache of generated raw data + OOB pages, one file per image
+ * in a cache directory, named by a hash of the image data, layout and
+ * geometry. Bump ECCCACHE_VERSION whenever genecc output changes.
+ */
+#define ECCCACHE_VERSION	1
+
+int ecccache_open(const char *dir, const unsigned char *image,
+		long long len, int layout, int page_data, int page_raw);
+const unsigned char *ecccache_pages(void);
+void ecccache_put(long long first, const unsigned char *raw, int npages);
+int ecccache_commit(void);
+void ecccache_close(void);
+
+#endif // ECCCACHE_H
@@ -0,0 +1,178 @@
+/*
+ * ECC worker pool: generate raw data + OOB pages of a block in background
+ * threads, so parity for the following pages is computed while the main
+ * thread is blocked programming the current one.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "eccpool.h"
+#include "trace.h"
+
+static pthread_t		*threads;
+static int				nthreads;
+static int				layout;
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	done_cond = PTHREAD_COND_INITIALIZER;
+static int				stopping;
+
+/* current job, protected by lock */
+static const u8			*job_src;
+static u8				*job_raw;
+static int				job_pages;
+static int				next_page;		// first page not yet claimed by a worker
+static int				busy;			// workers computing a chunk of this job
+static unsigned char	*page_ready;
+
+static void *ecc_worker(void *arg)
+{
+	int first, n, i;
+
+	TRACE_THREAD("ECC worker");
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!stopping && next_page >= job_pages)
+			pthread_cond_wait(&work_cond, &lock);
+		if (stopping)
+			break;
+
+		// claim pages in order so the writer's next page is done first
+		first = next_page;
+		n = job_pages - first;
+		if (n > genecc_batch_pages)
+			n = genecc_batch_pages;
+		next_page += n;
+		busy++;
+		pthread_mutex_unlock(&lock);
+
+		genecc_block(job_src + first * genecc_page_data,
+				job_raw + first * genecc_page_raw, n, layout);
+
+		pthread_mutex_lock(&lock);
+		for (i = first; i < first + n; i++)
+			page_ready[i] = 1;
+		busy--;
+		pthread_cond_broadcast(&done_cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * Start nthreads workers for blocks of up to max_pages pages.
+ * With nthreads 0 eccpool_submit() computes the block synchronously.
+ */
+int eccpool_start(int n, int lay, int max_pages)
+{
+	int i;
+
+	layout = lay;
+	stopping = 0;
+	job_pages = next_page = 0;
+	page_ready = calloc(max_pages, 1);
+	if (!page_ready)
+		return -1;
+	if (n <= 0)
+		return 0;
+
+	threads = calloc(n, sizeof(*threads));
+	if (!threads)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, ecc_worker, NULL) != 0) {
+			ERR("pthread_create failed, %d ECC workers\n", i);
+			break;
+		}
+	}
+	nthreads = i;
+	DBG("%d ECC workers\n", nthreads);
+	return 0;
+}
+
+/*
+ * Drop unclaimed pages of the current block and wait for busy workers, so
+ * its source and raw buffers may be reused.
+ */
+void eccpool_cancel(void)
+{
+	if (!nthreads)
+		return;
+
+	pthread_mutex_lock(&lock);
+	next_page = job_pages;
+	while (busy)
+		pthread_cond_wait(&done_cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Queue generation of npages raw pages from src into raw. Waits for workers
+ * still busy on the previous block, which may share the raw buffer.
+ * Unclaimed pages of the previous block are dropped.
+ */
+void eccpool_submit(const u8 *src, u8 *raw, int npages)
+{
+	if (!nthreads) {
+		genecc_block(src, raw, npages, layout);
+		job_raw = raw;
+		job_pages = npages;
+		memset(page_ready, 1, npages);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	while (busy)
+		pthread_cond_wait(&done_cond, &lock);
+	job_src = src;
+	job_raw = raw;
+	job_pages = npages;
+	next_page = 0;
+	memset(page_ready, 0, npages);
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Wait for a page of the current block and return its raw data + OOB */
+u8 *eccpool_page(int pagenum)
+{
+	if (nthreads) {
+		pthread_mutex_lock(&lock);
+		while (!page_ready[pagenum])
+			pthread_cond_wait(&done_cond, &lock);
+		pthread_mutex_unlock(&lock);
+	}
+	return job_raw + pagenum * genecc_page_raw;
+}
+
+void eccpool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	nthreads = 0;
+
+	free(threads);
+	threads = NULL;
+	free(page_ready);
+	page_ready = NULL;
+}
@@ -0,0 +1,12 @@
+#ifndef ECCPOOL_H
+#define ECCPOOL_H
+
+#include "genecc.h"
+
+int eccpool_start(int nthreads, int layout, int max_pages);
+void eccpool_cancel(void);
+void eccpool_submit(const u8 *src, u8 *raw, int npages);
+u8 *eccpool_page(int pagenum);
+void eccpool_stop(void);
+
+#endif // ECCPOOL_H
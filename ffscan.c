@@ -0,0 +1,211 @@
+/*
+ * Blank (all 0xFF) page detection. Each page is checked with wide vector
+ * ANDs, 128 bytes per branch, and a data page bails out at its first
+ * chunk, so a block's map costs about one pass over its blank pages.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define FFSCAN_X86
+#  include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define FFSCAN_NEON
+#  include <arm_neon.h>
+#  ifndef __aarch64__
+#    include <sys/auxv.h>
+#    include <asm/hwcap.h>
+#  endif
+#endif
+
+#include "debug.h"
+#include "ffscan.h"
+
+struct ffscan_backend {
+	const char	*name;
+	int			(*supported)(void);
+	int			(*is_ff)(const unsigned char *buf, int len);
+};
+
+/*
+ * ANDs 64-bit words together a chunk at a time, which the compiler turns
+ * into vector code where it can, only branching once per chunk.
+ */
+static int is_ff_scalar(const unsigned char *buf, int len)
+{
+	unsigned long long w, acc;
+	int i, chunk;
+
+	while (len >= 8) {
+		chunk = len < 256 ? len & ~7 : 256;
+		acc = ~0ULL;
+		for (i = 0; i < chunk; i += 8) {
+			memcpy(&w, buf + i, 8);
+			acc &= w;
+		}
+		if (acc != ~0ULL)
+			return 0;
+		buf += chunk;
+		len -= chunk;
+	}
+	while (len--)
+		if (*buf++ != 0xff)
+			return 0;
+	return 1;
+}
+
+static int scalar_supported(void)
+{
+	return 1;
+}
+
+#ifdef FFSCAN_X86
+
+static int sse2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static int avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#define LOAD128(p)	_mm_loadu_si128((const __m128i *)(p))
+
+__attribute__((target("sse2")))
+static int is_ff_sse2(const unsigned char *buf, int len)
+{
+	__m128i acc;
+
+	for (; len >= 128; buf += 128, len -= 128) {
+		acc = _mm_and_si128(
+				_mm_and_si128(
+					_mm_and_si128(LOAD128(buf), LOAD128(buf + 16)),
+					_mm_and_si128(LOAD128(buf + 32), LOAD128(buf + 48))),
+				_mm_and_si128(
+					_mm_and_si128(LOAD128(buf + 64), LOAD128(buf + 80)),
+					_mm_and_si128(LOAD128(buf + 96), LOAD128(buf + 112))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_set1_epi8(-1)))
+				!= 0xffff)
+			return 0;
+	}
+	return is_ff_scalar(buf, len);
+}
+
+#define LOAD256(p)	_mm256_loadu_si256((const __m256i *)(p))
+
+__attribute__((target("avx2")))
+static int is_ff_avx2(const unsigned char *buf, int len)
+{
+	__m256i acc;
+
+	for (; len >= 128; buf += 128, len -= 128) {
+		acc = _mm256_and_si256(
+				_mm256_and_si256(LOAD256(buf), LOAD256(buf + 32)),
+				_mm256_and_si256(LOAD256(buf + 64), LOAD256(buf + 96)));
+		// testc: set if acc has every bit of all-ones set
+		if (!_mm256_testc_si256(acc, _mm256_set1_epi8(-1)))
+			return 0;
+	}
+	return is_ff_scalar(buf, len);
+}
+
+#endif // FFSCAN_X86
+
+#ifdef FFSCAN_NEON
+
+static int neon_supported(void)
+{
+#ifdef __aarch64__
+	return 1;
+#else
+	return !!(getauxval(AT_HWCAP) & HWCAP_NEON);
+#endif
+}
+
+static int is_ff_neon(const unsigned char *buf, int len)
+{
+	uint8x16_t acc;
+	uint8x8_t half;
+
+	for (; len >= 128; buf += 128, len -= 128) {
+		acc = vandq_u8(
+				vandq_u8(
+					vandq_u8(vld1q_u8(buf), vld1q_u8(buf + 16)),
+					vandq_u8(vld1q_u8(buf + 32), vld1q_u8(buf + 48))),
+				vandq_u8(
+					vandq_u8(vld1q_u8(buf + 64), vld1q_u8(buf + 80)),
+					vandq_u8(vld1q_u8(buf + 96), vld1q_u8(buf + 112))));
+		half = vand_u8(vget_low_u8(acc), vget_high_u8(acc));
+		if (vget_lane_u64(vreinterpret_u64_u8(half), 0) != ~0ULL)
+			return 0;
+	}
+	return is_ff_scalar(buf, len);
+}
+
+#endif // FFSCAN_NEON
+
+/* widest first, ffscan_init() picks the first supported one */
+static const struct ffscan_backend backends[] = {
+#ifdef FFSCAN_X86
+	{ "avx2",	avx2_supported,		is_ff_avx2 },
+	{ "sse2",	sse2_supported,		is_ff_sse2 },
+#endif
+#ifdef FFSCAN_NEON
+	{ "neon",	neon_supported,		is_ff_neon },
+#endif
+	{ "scalar",	scalar_supported,	is_ff_scalar },
+};
+
+static const struct ffscan_backend *backend = &backends[
+		sizeof(backends) / sizeof(backends[0]) - 1];
+
+void ffscan_init(void)
+{
+	for (backend = backends; !backend->supported(); backend++)
+		;
+	DBG("FF scan backend: %s\n", backend->name);
+}
+
+const char *ffscan_backend_name(void)
+{
+	return backend->name;
+}
+
+/* All len bytes of buf 0xFF? */
+int ffscan_is_ff(const unsigned char *buf, int len)
+{
+	return backend->is_ff(buf, len);
+}
+
+/*
+ * Blank map of npages pages, stride bytes apart in buf: map[page] is 1 if
+ * the first len bytes of the page are all 0xFF, else 0. Returns the number
+ * of blank pages.
+ */
+int ffscan_pages(const unsigned char *buf, int stride, int len, int npages,
+		unsigned char *map)
+{
+	int page, blank = 0;
+
+	for (page = 0; page < npages; page++, buf += stride) {
+		map[page] = backend->is_ff(buf, len);
+		blank += map[page];
+	}
+	return blank;
+}
@@ -0,0 +1,10 @@
+#ifndef FFSCAN_H
+#define FFSCAN_H
+
+void ffscan_init(void);
+const char *ffscan_backend_name(void);
+int ffscan_is_ff(const unsigned char *buf, int len);
+int ffscan_pages(const unsigned char *buf, int stride, int len, int npages,
+		unsigned char *map);
+
+#endif // FFSCAN_H
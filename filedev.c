@@ -0,0 +1,365 @@
+/*
+ * File backed NAND device: a raw image of data + OOB per page, as a NAND
+ * programmer or nanddump would use. Lets flashtool build images offline
+ * and run without hardware.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "flashdev.h"
+
+static int			file_fd = -1;
+static struct mtd_info_user mi;
+static int			raw_pagesz;		// writesize + oobsize
+static int			nblocks;
+static unsigned char *bad;			// per block, 1 if bad
+static unsigned char *ff_block;		// one erased block, raw
+static unsigned char *page_tmp;		// one raw block
+static char			*bad_path;		// <file>.bad, the bad block list
+
+static off_t raw_off(long long off)
+{
+	return off / mi.writesize * raw_pagesz;
+}
+
+static int check_block(long long off)
+{
+	long long blk = off / mi.erasesize;
+
+	if (off < 0 || blk >= nblocks)
+		return -EINVAL;
+	return bad[blk] ? -EIO : 0;
+}
+
+static int file_erase(long long off)
+{
+	int ret;
+
+	DBG("erase block at 0x%llx\n", off);
+
+	if ((ret = check_block(off)) < 0)
+		return ret;
+	if (pwrite(file_fd, ff_block, (mi.erasesize / mi.writesize) * raw_pagesz,
+				raw_off(off)) < 0)
+		return -errno;
+	return 0;
+}
+
+static long long file_size(void)
+{
+	return (long long)nblocks * mi.erasesize;
+}
+
+static int file_is_bad(long long off)
+{
+	long long blk = off / mi.erasesize;
+
+	if (off < 0 || blk >= nblocks)
+		return -EINVAL;
+	return bad[blk];
+}
+
+/*
+ * Bad block status is kept in memory and appended to the bad block list,
+ * so the block is still bad the next time the file is opened. Also clear
+ * the first OOB byte of the block's first page, the factory marker, so
+ * the image carries it for a programmer.
+ */
+static int file_mark_bad(long long off)
+{
+	static const unsigned char zero;
+	long long blk = off / mi.erasesize;
+	FILE *f;
+
+	if (off < 0 || blk >= nblocks)
+		return -EINVAL;
+	if (!bad[blk]) {
+		f = fopen(bad_path, "a");
+		if (!f)
+			return -errno;
+		fprintf(f, "%lld\n", blk);
+		if (fclose(f) != 0)
+			return -errno;
+	}
+	bad[blk] = 1;
+	if (pwrite(file_fd, &zero, 1, raw_off(off - off % mi.erasesize) +
+				mi.writesize) != 1)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Read the bad block list, block numbers one per line, into bad[]. The
+ * markers in the image are not looked at: --legacy and --dm365-rbl put
+ * data and ECC where they would be. A missing list is no bad blocks.
+ * Returns 0, or -1 if it can not be read or is invalid.
+ */
+static int read_bad_list(void)
+{
+	FILE *f;
+	long long blk;
+	int ret = 0;
+
+	f = fopen(bad_path, "r");
+	if (!f)
+		return errno == ENOENT ? 0 : -1;
+	while ((ret = fscanf(f, "%lld", &blk)) == 1) {
+		if (blk < 0 || blk >= nblocks)
+			break;
+		bad[blk] = 1;
+	}
+	ret = ret == EOF && !ferror(f) ? 0 : -1;
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Program len bytes of a raw page at file offset pos. NAND programming can
+ * only clear bits, so AND with what is there, as the chip would.
+ */
+static int program(off_t pos, const unsigned char *buf, int len)
+{
+	int i;
+
+	if (pread(file_fd, page_tmp, len, pos) != len)
+		return -EIO;
+	for (i = 0; i < len; i++)
+		page_tmp[i] &= buf[i];
+	if (pwrite(file_fd, page_tmp, len, pos) != len)
+		return -errno;
+	return 0;
+}
+
+/*
+ * In-band pages. There is no ECC engine behind a file, so the OOB is left
+ * as it is.
+ */
+static int file_write(long long off, const unsigned char *buf, int len,
+		int *done)
+{
+	int ret;
+
+	for (*done = 0; *done < len; *done += mi.writesize) {
+		if ((ret = check_block(off + *done)) < 0)
+			return ret;
+		ret = program(raw_off(off + *done), buf + *done, mi.writesize);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int file_read(long long off, unsigned char *buf, int len)
+{
+	int done;
+
+	for (done = 0; done < len; done += mi.writesize) {
+		if (pread(file_fd, buf + done, mi.writesize, raw_off(off + done))
+				!= mi.writesize)
+			return -EIO;
+	}
+	return 0;
+}
+
+static int file_write_raw(long long off, const unsigned char *raw)
+{
+	int ret;
+
+	if ((ret = check_block(off)) < 0)
+		return ret;
+	return program(raw_off(off), raw, raw_pagesz);
+}
+
+/* The records are laid out in the file as they come, one pwrite for all */
+static int file_write_raw_run(long long off, const unsigned char *raw,
+		int npages, int *done)
+{
+	int ret;
+
+	*done = 0;
+	if ((ret = check_block(off)) < 0)
+		return ret;
+	if ((off % mi.erasesize) / mi.writesize + npages >
+			mi.erasesize / mi.writesize)
+		return -EINVAL;
+	if ((ret = program(raw_off(off), raw, npages * raw_pagesz)) < 0)
+		return ret;
+	*done = npages;
+	return 0;
+}
+
+static int file_read_raw(long long off, unsigned char *raw)
+{
+	if (pread(file_fd, raw, raw_pagesz, raw_off(off)) != raw_pagesz)
+		return -EIO;
+	return 0;
+}
+
+/* Records are back to back in the file too */
+static int file_read_raw_run(long long off, unsigned char *raw, int npages)
+{
+	if (pread(file_fd, raw, npages * raw_pagesz, raw_off(off)) !=
+			npages * raw_pagesz)
+		return -EIO;
+	return 0;
+}
+
+static void file_close(void)
+{
+	if (fsync(file_fd) != 0)
+		perror("fsync");
+	close(file_fd);
+	file_fd = -1;
+	free(bad);
+	free(ff_block);
+	free(page_tmp);
+	free(bad_path);
+}
+
+static const struct flashdev file_dev = {
+	.size		= file_size,
+	.erase		= file_erase,
+	.is_bad		= file_is_bad,
+	.mark_bad	= file_mark_bad,
+	.write		= file_write,
+	.read		= file_read,
+	.write_raw	= file_write_raw,
+	.read_raw	= file_read_raw,
+	.write_raw_run = file_write_raw_run,
+	.read_raw_run = file_read_raw_run,
+	.close		= file_close,
+};
+
+/*
+ * Open or create a raw NAND image file.
+ * geometry is "page:oob:pages-per-block[:blocks]"; without a block count
+ * the existing file size is used. A new or short file is extended with
+ * erased (FF) blocks. The blocks listed in <path>.bad are bad, the list
+ * starting empty with the file; badblocks is NULL or a comma separated
+ * list of more block numbers to mark bad. Fills in *info, returns NULL on
+ * error.
+ */
+const struct flashdev *filedev_open(const char *path, const char *geometry,
+		const char *badblocks, struct mtd_info_user *info)
+{
+	unsigned int pagesz, oobsz, ppb;
+	int blocks = -1;
+	struct stat st;
+	off_t size, raw_blocksz;
+	const char *p;
+	char *end;
+	long blk;
+
+	if (sscanf(geometry, "%u:%u:%u:%d", &pagesz, &oobsz, &ppb, &blocks) < 3
+			|| !pagesz || (pagesz & (pagesz - 1)) || !ppb || (ppb & (ppb - 1))) {
+		fprintf(stderr, "Bad NAND geometry \"%s\", want "
+				"page:oob:pages-per-block[:blocks]\n", geometry);
+		return NULL;
+	}
+
+	file_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (file_fd == -1) {
+		perror(path);
+		return NULL;
+	}
+
+	memset(&mi, 0, sizeof(mi));
+	mi.type = MTD_NANDFLASH;
+	mi.flags = MTD_CAP_NANDFLASH;
+	mi.writesize = pagesz;
+	mi.oobsize = oobsz;
+	mi.erasesize = pagesz * ppb;
+	raw_pagesz = pagesz + oobsz;
+	raw_blocksz = (off_t)raw_pagesz * ppb;
+
+	if (fstat(file_fd, &st) != 0) {
+		perror(path);
+		goto fail;
+	}
+	size = st.st_size;
+	if (blocks < 0)
+		blocks = size / raw_blocksz;
+	if (blocks <= 0) {
+		fprintf(stderr, "%s: no block count and no existing image\n", path);
+		goto fail;
+	}
+	nblocks = blocks;
+	// MEMGETINFO would truncate, flashtool sizes with file_size()
+	mi.size = file_size() > 0xffffffffLL ? 0xffffffffu : file_size();
+
+	bad = calloc(nblocks, 1);
+	ff_block = malloc(raw_blocksz);
+	page_tmp = malloc(raw_blocksz);
+	bad_path = malloc(strlen(path) + 5);
+	if (!bad || !ff_block || !page_tmp || !bad_path) {
+		ERR("malloc failed\n");
+		goto fail;
+	}
+	memset(ff_block, 0xff, raw_blocksz);
+	sprintf(bad_path, "%s.bad", path);
+
+	// round down a partial last block, then extend with erased blocks
+	for (size -= size % raw_blocksz; size < (off_t)nblocks * raw_blocksz;
+			size += raw_blocksz) {
+		if (pwrite(file_fd, ff_block, raw_blocksz, size) != raw_blocksz) {
+			perror(path);
+			goto fail;
+		}
+	}
+
+	// a new image starts with no bad blocks, whatever an old list says
+	if (st.st_size == 0 && unlink(bad_path) != 0 && errno != ENOENT) {
+		perror(bad_path);
+		goto fail;
+	}
+	if (read_bad_list() < 0) {
+		fprintf(stderr, "Bad block list %s invalid\n", bad_path);
+		goto fail;
+	}
+
+	for (p = badblocks; p && *p; p = end + (*end == ',')) {
+		blk = strtol(p, &end, 0);
+		if (end == p || (*end && *end != ',') || blk < 0 || blk >= nblocks) {
+			fprintf(stderr, "Bad block list \"%s\" invalid\n", badblocks);
+			goto fail;
+		}
+		if (file_mark_bad((long long)blk * mi.erasesize) < 0) {
+			perror(path);
+			goto fail;
+		}
+	}
+
+	DBG("%s: %d blocks of %d x (%d + %d)\n", path, nblocks, ppb,
+			pagesz, oobsz);
+	*info = mi;
+	return &file_dev;
+
+fail:
+	close(file_fd);
+	file_fd = -1;
+	free(bad);
+	free(ff_block);
+	free(page_tmp);
+	free(bad_path);
+	bad = ff_block = page_tmp = NULL;
+	bad_path = NULL;
+	return NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef FLASHDEV_H
+#define FLASHDEV_H
+
+#include <mtd/mtd-user.h>
+
+/*
+ * Flash device backend. Offsets are 64-bit in-band byte offsets from the
+ * start of the device, page or block aligned. Calls return 0 or -errno
+ * unless noted.
+ */
+struct flashdev {
+	long long (*size)(void);		// in-band bytes, mi.size is only 32-bit
+	int		(*erase)(long long off);
+	int		(*is_bad)(long long off);	// 1 bad, 0 good, or -errno
+	int		(*mark_bad)(long long off);
+	/*
+	 * In-band pages, ECC done by the device. On failure *done is the number
+	 * of bytes known to have been written.
+	 */
+	int		(*write)(long long off, const unsigned char *buf, int len,
+				int *done);
+	int		(*read)(long long off, unsigned char *buf, int len);
+	// one page, data + OOB as stored, no ECC
+	int		(*write_raw)(long long off, const unsigned char *raw);
+	int		(*read_raw)(long long off, unsigned char *raw);
+	/*
+	 * npages raw pages in one block, data + OOB records back to back, in as
+	 * few program calls as the device allows. On failure *done is the
+	 * number of pages known to have been written.
+	 */
+	int		(*write_raw_run)(long long off, const unsigned char *raw,
+				int npages, int *done);
+	// and read back the same way
+	int		(*read_raw_run)(long long off, unsigned char *raw, int npages);
+	void	(*close)(void);
+};
+
+// mtddev_open() flags
+#define MTDDEV_RAW			0x1		// raw page writes will be used
+#define MTDDEV_NO_MEMWRITE	0x2		// use write + MEMWRITEOOB for them
+#define MTDDEV_RDONLY		0x4		// only reading, open O_RDONLY
+
+const struct flashdev *mtddev_open(const char *path, int flags,
+		struct mtd_info_user *mi);
+const struct flashdev *filedev_open(const char *path, const char *geometry,
+		const char *badblocks, struct mtd_info_user *mi);
+
+#endif // FLASHDEV_H
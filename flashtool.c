@@ -16,22 +16,30 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
-#include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <mtd/mtd-user.h>
-
 #include "debug.h"
 
 #include "genecc.h"
+#include "eccpool.h"
+#include "ecccache.h"
+#include "imgread.h"
+#include "imgwrite.h"
+#include "flashdev.h"
+#include "decomp.h"
+#include "ffscan.h"
+#include "stats.h"
+#include "trace.h"
 
 enum exit_codes {
 	EXIT_OK			= 0,
@@ -40,29 +48,92 @@ enum exit_codes {
 	EXIT_NOSPACE	= 3,	// not enough space (maybe due to bad blocks)
 };
 
-// using ints, can handle up to 2GiB MTD partitions.
+// offsets and lengths are 64-bit, page and block counts int
 static char			*image_path;
 static char			*mtd_path;
 static int			image_fd = -1;
-static int			mtd_fd;
-static int			max_off = -1;		// excluding OOB
-static int			start_off = -1;		// excluding OOB
-static int			req_length = -1;	// excluding OOB
-static int 			req_pages;
-static int			input_size;
+static const struct flashdev *dev;
+static char			*file_geometry;		// --file-nand: mtd-device is an image
+static char			*badblock_list;
+static long long	max_off = -1;		// excluding OOB
+static long long	start_off = -1;		// excluding OOB
+static long long	req_length = -1;	// excluding OOB
+static long long	req_pages;
+static long long	input_size;
+static long long	dev_size;			// dev->size(), mi.size is 32-bit
 static int			failbad;
 static int			write_mode;
 static int			erase_mode;
+static int			read_mode;
+static int			read_oob;			// -r: data + OOB records, raw
+static int			pad_bad;			// -r: bad blocks kept in the output
+static int			to_end;				// -r without -l: up to max_off
+static int			bad_blocks_read;	// -r: bad blocks skipped or padded
 static int			legacy;
 static int			dm365_rbl;
 static int			ubi = 0;
 static int			genecc;
+static int			genecc_layout;
+static int			raw_input;			// image is data + OOB per page
+static int			to_eof;				// streamed image, no -l: length unknown
+static char			*decompress;		// --decompress format
+static int			sparse;
+static const unsigned char *page_skip;	// sparse: per page of block_buf
+static int			pages_skipped;		// sparse: don't care, not programmed
+static int			skip_blank;			// --skip-blank: raw records all FF
+static unsigned char *page_blank;		// --ubi, --skip-blank: per page
+static int			blank_skipped;		// blank pages not programmed
+static int			verify;				// --verify: decode written pages
+static int			verify_max = 2;		// bitflips per subpage before failing
+#define VERIFY_HIST		6				// 0..4+ bitflips, uncorrectable
+static int			verify_hist[VERIFY_HIST];
+static int			*verify_flips;		// per subpage of a block
+static unsigned char *verify_buf;		// raw pages read back
+static char			*stats_path;		// --stats: JSON summary at exit
+#ifdef HAVE_STATS
+static char			*trace_path;		// --trace: timeline at exit
+static int			trace_events;		// --trace: events per thread, 0 default
+#endif
+static int			copies = 1;			// --copies: image written this many times
+static int			copy_stride;		// blocks from one copy's start to the next
+static int			copies_contig;		// each copy in good blocks in a row
+static unsigned char *copy_buf;			// --copies: the image's pages, as programmed
+static int			bad_skipped;		// bad blocks skipped while writing
+static int			marked_bad;
+static int			img_page_sz;		// bytes per page in block_buf or -r output
 static int			quiet;
+static int			ecc_threads = -1;	// default: one per CPU
+static int			no_mmap;
+static int			no_memwrite;
+static int			diff_mode;
+static int			blocks_unchanged;	// --diff: erase + write skipped
+static int			blocks_written;
+static int			skip_erased;
+static int			erases_avoided;		// --skip-erased: block was blank
 static int			block_pages;
 static struct mtd_info_user mi;
-static unsigned char *page_buf, *block_buf;
-static int			block_off;
-static int			bytes_done;			// data bytes successfuly (written)
+static unsigned char *page_buf, *block_buf;	// block_buf: img_page_sz pages
+static unsigned char *block_raw;		// genecc: raw data + OOB pages of block
+static unsigned char *readback_buf;		// --diff, --skip-erased: flash data
+static char			*ecc_cache_dir;		// --ecc-cache
+static const unsigned char *cache_raw;	// cache hit: the image's raw pages
+static int			cache_store;		// cache miss: raw pages go in a new entry
+static int			img_block;			// image blocks taken by next_image_block()
+static long long	cache_page0;		// image page of block_buf's page 0
+
+/*
+ * Bad block bitmap of [scan_start, max_off), one bit per block, filled in
+ * before anything is written by scan_bad_blocks()
+ */
+#define SCAN_THREADS_MAX	4
+#define SCAN_BLOCKS_PER_THREAD	256
+// mi.erasesize is u32, widen before inverting
+#define BLOCK_START(off)	((off) & ~((long long)mi.erasesize - 1))
+static unsigned char *bad_map;
+static long long	scan_start;
+static int			scan_blocks;
+static long long	block_off;
+static long long	bytes_done;			// data bytes successfuly (written)
 static int			block_bytes_done;
 
 void usage(void)
@@ -71,17 +142,61 @@ void usage(void)
 "Usage:\n"
 "  flashtool [OPTIONS] mtd-device [image-file]\n\n"
 "  mtd-device       Target MTD partition in mtdX or /dev/mtdX format\n"
-"  image-file       Source data if writing\n"
+"  image-file       Source data if writing, - for stdin. Pipes and sockets\n"
+"                   are streamed, up to EOF if there is no -l\n"
+"                   Destination if reading, - for stdout (implies -q)\n"
 "OPTIONS:\n"
 "  -w, --write      Write image-file\n"
 "  -e, --erase      Erase blocks; with -w, erase-before-write\n"
+"  -r, --read       Read into image-file, skipping bad blocks\n"
 "  -s, --start x    Offset from partition start, in bytes\n"
-"  -l, --length x   In bytes, else input file length is used\n"
+"  -l, --length x   In bytes, else input file length is used, or with -r\n"
+"                   up to max offset (page data only with --raw-input\n"
+"                   or --oob)\n"
+"      --oob        With -r, read data + OOB of each page raw, as\n"
+"                   --raw-input takes it\n"
+"      --padbad     With -r, output bad blocks in place, as FF (with a\n"
+"                   0 bad block marker in the first OOB byte with --oob)\n"
 "      --failbad    Fail if any bad block is found\n"
 "      --maxoff x   Do not go above this absolute offset\n"
 "      --legacy     Write legacy infix OOB layout\n"
 "      --dm365-rbl  Write DM365 RBL compatible OOB layout\n"
-"      --ubi        UBI writing: per block, skip trailing all-FF pages\n"
+"      --raw-input  image-file holds data + OOB of each page, written raw\n"
+"      --decompress fmt  image-file is gzip, zstd, lz4 or auto (by magic)\n"
+"                   compressed; -l is the uncompressed length\n"
+"      --sparse     image-file is in mksparse format, don't care pages are\n"
+"                   not read or programmed\n"
+"      --ubi        UBI writing: skip pages with all-FF data, trailing or\n"
+"                   not\n"
+"      --skip-blank With --raw-input, do not program all-FF records\n"
+"      --threads n  ECC worker threads, 0 for none (default: CPU count)\n"
+"      --no-mmap    Read image-file into buffers even if it can be mapped\n"
+"      --no-memwrite  With genecc or --raw-input, write data and OOB with separate calls\n"
+"      --verify[=n] With --legacy or --dm365-rbl, read back each block\n"
+"                   raw, decode it and compare it with what was written;\n"
+"                   over n bitflips in a subpage (default 2),\n"
+"                   uncorrectable or different: mark bad and rewrite\n"
+"      --diff       Read blocks back first, skip those already up to date\n"
+"      --ecc-cache dir  With --legacy or --dm365-rbl, keep the generated\n"
+"                   pages of each image in dir and use them again for\n"
+"                   the same image instead of generating ECC\n"
+"      --copies n[,stride]  Write the image n times, one copy after the\n"
+"                   other or each stride blocks after the last one's start;\n"
+"                   ECC is generated once\n"
+"      --copies-contig  With --copies, keep each copy in good blocks in a\n"
+"                   row: move it past bad blocks, and start it again\n"
+"                   after a block that fails\n"
+"      --skip-erased  With -e, do not erase blocks that read as all FF\n"
+"      --stats file Write operation timings and counts as JSON at exit,\n"
+"                   - for stdout\n"
+"      --trace file[,events]  Write a timeline of the run at exit, Chrome\n"
+"                   trace JSON for Perfetto, keeping the last events\n"
+"                   (default 16384) of each thread\n"
+"      --file-nand geom  mtd-device is a raw NAND image file (data + OOB\n"
+"                   per page), created if needed. geom is\n"
+"                   page:oob:pages-per-block[:blocks]. Bad blocks are\n"
+"                   kept in a list in mtd-device.bad\n"
+"      --badblocks list  With --file-nand, comma separated blocks to mark bad\n"
 "  -q, --quiet\n"
 "\n"
 	);
@@ -108,15 +223,35 @@ void handle_options(int argc, char *argv[])
 
 	for (;;) {
 		int option_index = 0;
-		static const char *short_options = "wes:l:q";
+		static const char *short_options = "wers:l:q";
 		static const struct option long_options[] = {
 			{"failbad",		no_argument,		0, 0},
 			{"maxoff",		required_argument,	0, 0},
 			{"legacy",		no_argument,		0, 0},
 			{"ubi",			no_argument,		0, 0},
 			{"dm365-rbl",	no_argument,		0, 0},
+			{"threads",		required_argument,	0, 0},
+			{"no-mmap",		no_argument,		0, 0},
+			{"no-memwrite",	no_argument,		0, 0},
+			{"diff",		no_argument,		0, 0},
+			{"skip-erased",	no_argument,		0, 0},
+			{"file-nand",	required_argument,	0, 0},
+			{"badblocks",	required_argument,	0, 0},
+			{"raw-input",	no_argument,		0, 0},
+			{"decompress",	required_argument,	0, 0},
+			{"sparse",		no_argument,		0, 0},
+			{"skip-blank",	no_argument,		0, 0},
+			{"oob",			no_argument,		0, 0},
+			{"padbad",		no_argument,		0, 0},
+			{"verify",		optional_argument,	0, 0},
+			{"stats",		required_argument,	0, 0},
+			{"trace",		required_argument,	0, 0},
+			{"copies",		required_argument,	0, 0},
+			{"ecc-cache",	required_argument,	0, 0},
+			{"copies-contig", no_argument,		0, 0},
 			{"write",		no_argument,		0, 'w'},
 			{"erase",		no_argument,		0, 'e'},
+			{"read",		no_argument,		0, 'r'},
 			{"start",		required_argument,	0, 's'},
 			{"length",		required_argument,	0, 'l'},
 			{"quiet",		no_argument,		0, 'q'},
@@ -147,6 +282,99 @@ void handle_options(int argc, char *argv[])
 			case 4:
 				dm365_rbl = 1;
 				break;
+			case 5:
+				ecc_threads = llarg();
+				break;
+			case 6:
+				no_mmap = 1;
+				break;
+			case 7:
+				no_memwrite = 1;
+				break;
+			case 8:
+				diff_mode = 1;
+				break;
+			case 9:
+				skip_erased = 1;
+				break;
+			case 10:
+				file_geometry = strdup(optarg);
+				break;
+			case 11:
+				badblock_list = strdup(optarg);
+				break;
+			case 12:
+				raw_input = 1;
+				break;
+			case 13:
+				decompress = strdup(optarg);
+				break;
+			case 14:
+				sparse = 1;
+				break;
+			case 15:
+				skip_blank = 1;
+				break;
+			case 16:
+				read_oob = 1;
+				break;
+			case 17:
+				pad_bad = 1;
+				break;
+			case 18:
+				verify = 1;
+				if (optarg)
+					verify_max = llarg();
+				break;
+			case 19:
+#ifdef HAVE_STATS
+				stats_path = strdup(optarg);
+#else
+				fprintf(stderr, "--stats not built in\n");
+				error = 1;
+#endif
+				break;
+			case 20:
+#ifdef HAVE_STATS
+			{
+				char *comma, *end;
+
+				trace_path = strdup(optarg);
+				comma = strrchr(trace_path, ',');
+				if (comma) {
+					*comma = '\0';
+					trace_events = strtol(comma + 1, &end, 0);
+					if (*end || trace_events < 1 ||
+							trace_events > TRACE_EVENTS_MAX) {
+						fprintf(stderr, "Bad --trace argument %s\n",
+								optarg);
+						error = 1;
+					}
+				}
+			}
+#else
+				fprintf(stderr, "--trace not built in\n");
+				error = 1;
+#endif
+				break;
+			case 21: {
+				char *end;
+
+				copies = strtol(optarg, &end, 0);
+				if (*end == ',')
+					copy_stride = strtol(end + 1, &end, 0);
+				if (*end || copies < 1 || copy_stride < 0) {
+					fprintf(stderr, "Bad --copies argument %s\n", optarg);
+					error = 1;
+				}
+				break;
+			}
+			case 22:
+				ecc_cache_dir = strdup(optarg);
+				break;
+			case 23:
+				copies_contig = 1;
+				break;
 			}
 			break;
 		case 'w':
@@ -155,6 +383,9 @@ void handle_options(int argc, char *argv[])
 		case 'e':
 			erase_mode = 1;
 			break;
+		case 'r':
+			read_mode = 1;
+			break;
 		case 's':
 			start_off = llarg();
 			break;
@@ -171,7 +402,7 @@ void handle_options(int argc, char *argv[])
 	}
 
 	if (optind < argc) {
-		if (0 == strncmp(argv[optind], "mtd", 3)) {
+		if (!file_geometry && 0 == strncmp(argv[optind], "mtd", 3)) {
 			mtd_path = malloc(strlen(argv[optind]) + 4);
 			sprintf(mtd_path, "/dev/%s", argv[optind]);
 		} else {
@@ -183,20 +414,31 @@ void handle_options(int argc, char *argv[])
 		error = 1;
 	}
 
-	if (write_mode) {
+	if (write_mode || read_mode) {
 		if (optind < argc) {
 			image_path = strdup(argv[optind]);
 			optind++;
 		} else {
-			fprintf(stderr, "Must supply input filename with -w\n");
+			fprintf(stderr, "Must supply %s filename with -%c\n",
+					write_mode ? "input" : "output", write_mode ? 'w' : 'r');
 			error = 1;
 		}
 	} else if (req_length < 0) {
 		fprintf(stderr, "Must supply length if not writing\n");
 	}
 
-	if (!write_mode && !erase_mode) {
-		fprintf(stderr, "Must set either -w or -e.\n");
+	if (!write_mode && !erase_mode && !read_mode) {
+		fprintf(stderr, "Must set either -w, -e or -r.\n");
+		error = 1;
+	}
+
+	if (read_mode && (write_mode || erase_mode)) {
+		fprintf(stderr, "-r can not be combined with -w or -e\n");
+		error = 1;
+	}
+
+	if ((read_oob || pad_bad) && !read_mode) {
+		fprintf(stderr, "--oob and --padbad need -r\n");
 		error = 1;
 	}
 
@@ -205,13 +447,63 @@ void handle_options(int argc, char *argv[])
 		error = 1;
 	}
 
+	if (diff_mode && !write_mode) {
+		fprintf(stderr, "--diff needs -w\n");
+		error = 1;
+	}
+
+	if (badblock_list && !file_geometry) {
+		fprintf(stderr, "--badblocks needs --file-nand\n");
+		error = 1;
+	}
+
 	if (legacy && dm365_rbl) {
 		fprintf(stderr, "legacy and dm365_rbl modes are mutually exclusive\n");
 		error = 1;
 	}
 
+	if (raw_input && (legacy || dm365_rbl)) {
+		fprintf(stderr, "--raw-input images already have their OOB\n");
+		error = 1;
+	}
+
+	if (verify && (!write_mode || !(legacy || dm365_rbl))) {
+		// only the software layouts are known to be this code
+		fprintf(stderr, "--verify needs -w and --legacy or --dm365-rbl\n");
+		error = 1;
+	}
+
+	if (verify_max < 0 || verify_max > 4) {
+		fprintf(stderr, "--verify threshold must be 0 to 4 bitflips\n");
+		error = 1;
+	}
+
+	if (ecc_cache_dir && (!write_mode || !(legacy || dm365_rbl))) {
+		// in-band and raw input pages have no generated ECC to keep
+		fprintf(stderr, "--ecc-cache needs -w and --legacy or --dm365-rbl\n");
+		error = 1;
+	}
+
+	if (copies > 1 && (!write_mode || diff_mode || sparse || ubi ||
+				skip_blank)) {
+		// the copies are programmed whole, from pages kept in memory
+		fprintf(stderr, "--copies needs -w, and can not be combined with "
+				"--diff, --sparse, --ubi or --skip-blank\n");
+		error = 1;
+	}
+	if (copies_contig && copies < 2) {
+		fprintf(stderr, "--copies-contig needs --copies\n");
+		error = 1;
+	}
+
+	if (skip_blank && !raw_input) {
+		// generated or hardware ECC of an FF page is not FF
+		fprintf(stderr, "--skip-blank needs --raw-input\n");
+		error = 1;
+	}
+
 	if (optind < argc) {
-		if (!write_mode) {
+		if (!write_mode && !read_mode) {
 			fprintf(stderr, "Input file without -w ?\n");
 		}
 		fprintf(stderr, "Too many commandline arguments\n");
@@ -222,165 +514,979 @@ void handle_options(int argc, char *argv[])
 		usage();
 		exit(EXIT_FAIL);
 	}
+
+	// stdout is the image
+	if (read_mode && !strcmp(image_path, "-")) {
+		quiet = 1;
+		if (stats_path && !strcmp(stats_path, "-")) {
+			fprintf(stderr, "--stats - and -r to stdout\n");
+			exit(EXIT_FAIL);
+		}
+	}
 }
 
 void dump_stats(void)
 {
-	fprintf(stderr, "MTD device size:  0x%-8x bytes\n", mi.size);
-	fprintf(stderr, "Max offset:       0x%-8x\n", max_off);
-	fprintf(stderr, "Requested length: 0x%-8x bytes\n", req_length);
+	fprintf(stderr, "MTD device size:  0x%-8llx bytes\n", dev_size);
+	fprintf(stderr, "Max offset:       0x%-8llx\n", max_off);
+	fprintf(stderr, "Requested length: 0x%-8llx bytes\n", req_length);
 	fprintf(stderr, "Page size:        0x%-8x bytes\n", mi.writesize);
-	fprintf(stderr, "Pages needed:     %-6d\n", req_pages);
+	fprintf(stderr, "Pages needed:     %-6lld\n", req_pages);
+	if (write_mode)
+		fprintf(stderr, "Input file:       0x%-8llx bytes\n", input_size);
+	fprintf(stderr, "Start offset:     0x%llx\n", start_off);
+	fprintf(stderr, "This block start: 0x%llx\n", block_off);
+	fprintf(stderr, "Bytes done ok:    0x%llx\n", bytes_done);
 	if (write_mode)
-		fprintf(stderr, "Input file:       0x%-8x bytes\n", input_size);
-	fprintf(stderr, "Start offset:     0x%x\n", start_off);
-	fprintf(stderr, "This block start: 0x%x\n", block_off);
-	fprintf(stderr, "Bytes done ok:    0x%x\n", bytes_done);
+		fprintf(stderr, "Input wait:       %.3f s\n", imgread_wait_time());
 	
 }
 
-int erase_block(int offset)
+int erase_block(long long offset)
+{
+	int ret;
+	STATS_VAR(t0);
+
+	STATS_BEGIN(t0);
+	ret = dev->erase(offset);
+	STATS_END(STAT_ERASE, t0, mi.erasesize, offset);
+	return ret;
+}
+
+static void set_map_bad(long long blockoff)
+{
+	int b = (blockoff - scan_start) / mi.erasesize;
+
+	if (bad_map && blockoff >= scan_start && b < scan_blocks)
+		bad_map[b / 8] |= 1 << (b % 8);
+}
+
+struct scan_job {
+	int first;		// block index in bad_map, multiple of 8
+	int n;
+	int err;
+};
+
+static void *scan_thread(void *arg)
+{
+	struct scan_job *job = arg;
+	int b, ret;
+	STATS_VAR(t0);
+
+	// whole bytes of bad_map belong to one job, no locking needed
+	for (b = job->first; b < job->first + job->n; b++) {
+		STATS_BEGIN(t0);
+		ret = dev->is_bad(scan_start + (long long)b * mi.erasesize);
+		STATS_END(STAT_BAD_CHECK, t0, 0,
+				scan_start + (long long)b * mi.erasesize);
+		if (ret < 0) {
+			job->err = -ret;
+			break;
+		}
+		if (ret)
+			bad_map[b / 8] |= 1 << (b % 8);
+	}
+	return NULL;
+}
+
+static void *scan_thread_start(void *arg)
+{
+	TRACE_THREAD("bad block scan");
+	return scan_thread(arg);
+}
+
+/*
+ * Get the bad block status of every block from first_block up to max_off.
+ * MEMGETBADBLOCK is one block per call and may have to read OOB if there
+ * is no BBT, so large ranges are split over a few threads.
+ * Backends' is_bad() must be safe to call from several threads.
+ */
+void scan_bad_blocks(long long first_block)
+{
+	struct scan_job jobs[SCAN_THREADS_MAX];
+	pthread_t threads[SCAN_THREADS_MAX];
+	int started[SCAN_THREADS_MAX];
+	int nthreads, per, i;
+
+	scan_start = first_block;
+	scan_blocks = (max_off - first_block + mi.erasesize - 1) / mi.erasesize;
+	bad_map = calloc((scan_blocks + 7) / 8, 1);
+	if (!bad_map) {
+		fprintf(stderr, "bad_map malloc failed\n");
+		exit(EXIT_FAIL);
+	}
+
+	nthreads = scan_blocks / SCAN_BLOCKS_PER_THREAD;
+	if (nthreads > SCAN_THREADS_MAX)
+		nthreads = SCAN_THREADS_MAX;
+	if (nthreads < 1)
+		nthreads = 1;
+	per = ((scan_blocks / nthreads) + 7) & ~7;
+
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].first = i * per;
+		jobs[i].n = scan_blocks - jobs[i].first;
+		if (jobs[i].n > per)
+			jobs[i].n = per;
+		if (jobs[i].n < 0)
+			jobs[i].n = 0;
+		jobs[i].err = 0;
+		started[i] = i > 0 &&
+			pthread_create(&threads[i], NULL, scan_thread_start, &jobs[i]) == 0;
+	}
+	// job 0, and any we could not get a thread for, run here
+	for (i = 0; i < nthreads; i++)
+		if (!started[i])
+			scan_thread(&jobs[i]);
+	for (i = 0; i < nthreads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		if (jobs[i].err) {
+			errno = jobs[i].err;
+			perror("MEMGETBADBLOCK");
+			exit(EXIT_FAIL);
+		}
+	}
+	DBG("scanned %d blocks with %d threads\n", scan_blocks, nthreads);
+}
+
+/* Bad block status from the scan, or asking the device if out of range */
+int block_is_bad(long long blockoff)
 {
-	struct erase_info_user ei;
+	int b = (blockoff - scan_start) / mi.erasesize;
+	int ret;
+	STATS_VAR(t0);
+
+	if (bad_map && blockoff >= scan_start && b < scan_blocks)
+		return (bad_map[b / 8] >> (b % 8)) & 1;
+
+	STATS_BEGIN(t0);
+	ret = dev->is_bad(blockoff);
+	STATS_END(STAT_BAD_CHECK, t0, 0, blockoff);
+	if (ret < 0) {
+		errno = -ret;
+		perror("MEMGETBADBLOCK");
+		exit(EXIT_FAIL);
+	}
+	return ret;
+}
 
-	DBG("erase block at 0x%x\n", offset);
+/*
+ * Walk the known bad blocks the way the main loop will and fail now,
+ * before anything is erased or written, if the request cannot be placed
+ * below max_off (or at all, with --failbad).
+ */
+void check_write_plan(void)
+{
+	long long need, good, blockoff, end;
+	int pad, last_len, bad;
+
+	pad = start_off & (mi.erasesize - 1);
+	need = (pad + req_length + mi.erasesize - 1) / mi.erasesize;
+	last_len = pad + req_length - (need - 1) * mi.erasesize;
+
+	good = bad = 0;
+	for (blockoff = BLOCK_START(start_off); ;
+			blockoff += mi.erasesize) {
+		if (blockoff >= max_off) {
+			dump_stats();
+			fprintf(stderr, "Request with %d bad blocks would exceed max "
+					"offset limit\n", bad);
+			exit(EXIT_NOSPACE);
+		}
+		if (block_is_bad(blockoff)) {
+			if (failbad) {
+				fprintf(stderr, "Bad block at 0x%llx : ABORT\n", blockoff);
+				exit(EXIT_BADBLOCK);
+			}
+			bad++;
+			continue;
+		}
+		if (++good == need)
+			break;
+	}
 
-	ei.start = offset;
-	ei.length = mi.erasesize;
+	// the last block is erased whole, or written up to the last page
+	if (erase_mode)
+		end = blockoff + mi.erasesize;
+	else
+		end = blockoff + ((last_len + mi.writesize - 1) & ~(mi.writesize - 1));
+	if (end > max_off) {
+		dump_stats();
+		fprintf(stderr, "Request with %d bad blocks would exceed max "
+				"offset limit\n", bad);
+		exit(EXIT_NOSPACE);
+	}
 
-	return ioctl(mtd_fd, MEMERASE, &ei);
+	if (!quiet && bad)
+		printf("%d bad blocks to skip, last block at 0x%llx\n", bad, blockoff);
 }
 
-int mark_block_bad(loff_t offset)
+int mark_block_bad(long long offset)
 {
 	fprintf(stderr, "mark block bad at 0x%llx\n", offset);
+	marked_bad++;
+	TRACE_MARK("mark bad", offset);
 
-	/*
-	 * This ioctl may only set the BBT (not sure).
-	 * We should possibly try to write the manufacturer bad block markers
-	 * in the block itself, for the UBL.
-	 */
-	return ioctl(mtd_fd, MEMSETBADBLOCK, &offset);
+	if (dev->mark_bad(offset) != 0)
+		return -1;
+	set_map_bad(offset);
+	return 0;
 
 	printf("DISABLED: mark block bad at 0x%llx\n", offset);
 	return 0;
 }
 
-int write_page(int blockoff, int pagenum)
+/* Erase a block that failed and mark it bad. Exits if it can't be marked. */
+static void drop_block(long long blockoff)
 {
-	unsigned char *writeme, *srcdata;
-	off_t pageoff;
-	int ret;
+	if (erase_block(blockoff) < 0) {
+		fprintf(stderr, "Erase block at 0x%llx failed\n", blockoff);
+		// This isn't so important as we are about to mark bad
+	}
+	if (mark_block_bad(blockoff) < 0) {
+		fprintf(stderr, "Marking block bad at 0x%llx failed\n", blockoff);
+		// If not marked bad it would be misread, so this is fatal
+		exit(EXIT_FAIL);
+	}
+}
+
+/*
+ * A block failed to write or verify, the caller has said so: with
+ * --failbad give up, else erase it and mark it bad so the image block can
+ * go to the next one.
+ */
+void retire_block(long long blockoff)
+{
+	if (failbad) {
+		fprintf(stderr, "ABORT\n");
+		exit(EXIT_BADBLOCK);
+	} else {
+		fprintf(stderr, "Mark bad and skip\n");
+	}
+	drop_block(blockoff);
+}
+
+/* genecc: raw data + OOB of page pagenum of block_buf, from the cache or made */
+static unsigned char *raw_page(int pagenum)
+{
+	if (cache_raw)
+		return (unsigned char *)cache_raw +
+			(cache_page0 + pagenum) * genecc_page_raw;
+	return eccpool_page(pagenum);
+}
+
+int write_page(long long blockoff, int pagenum)
+{
+	unsigned char *writeme;
+	long long pageoff;
+	int done, ret;
+	STATS_VAR(t0);
 
 	pageoff = blockoff + pagenum * mi.writesize;
-	srcdata = &block_buf[pagenum * mi.writesize];
+
+	DBG("0x%llx (#%-2d of block)\n", pageoff, pagenum);
+
 	if (genecc) {
-		int layout = 0;
+		// page data + OOB, generated per block by the ECC workers
+		STATS_BEGIN(t0);
+		writeme = raw_page(pagenum);
+		STATS_END(STAT_ECC_WAIT, t0, 0, pageoff);
+		STATS_BEGIN(t0);
+		ret = dev->write_raw(pageoff, writeme);
+	} else {
+		writeme = &block_buf[pagenum * mi.writesize];	// page data only
+		STATS_BEGIN(t0);
+		ret = dev->write(pageoff, writeme, mi.writesize, &done);
+	}
+	STATS_END(STAT_PROGRAM, t0, mi.writesize, pageoff);
+	return ret;
+}
+
+/* Read in-band data and OOB of a page without ECC correction into raw */
+int read_raw_page(long long pageoff, unsigned char *raw)
+{
+	int ret;
+	STATS_VAR(t0);
+
+	STATS_BEGIN(t0);
+	ret = dev->read_raw(pageoff, raw);
+	STATS_END(STAT_READ, t0, mi.writesize + mi.oobsize, pageoff);
+	return ret;
+}
 
-		if (legacy) {
-			layout = GENECC_LAYOUT_LEGACY;
-		} else if (dm365_rbl) {
-			layout = GENECC_LAYOUT_DM365_RBL;
+/*
+ * --skip-erased: read every page of the block raw, data and OOB, and
+ * return 1 if it is all FF, i.e. erasing it would change nothing.
+ */
+int block_erased(long long blockoff)
+{
+	int page;
+
+	for (page = 0; page < block_pages; page++) {
+		if (read_raw_page(blockoff + page * mi.writesize, readback_buf) < 0)
+			return 0;
+		if (!ffscan_is_ff(readback_buf, mi.writesize + mi.oobsize))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * --diff: does the block at blockoff already hold what erasing (if -e) and
+ * writing pages [first, last) of the current image block would leave?
+ * Pages outside that range must read as erased if erasing, and are not
+ * looked at otherwise. genecc and raw input blocks are compared raw, OOB
+ * included.
+ * Read errors count as a difference.
+ */
+int block_unchanged(long long blockoff, int first, int last)
+{
+	unsigned char *want, *got;
+	int raw, raw_sz, page, ret;
+	long long off;
+	STATS_VAR(t0);
+
+	raw = genecc || raw_input;
+	raw_sz = mi.writesize + (raw ? mi.oobsize : 0);
+
+	if (!raw) {
+		// in-band only, ECC corrected: one read for the whole block
+		STATS_BEGIN(t0);
+		ret = dev->read(blockoff, readback_buf, mi.erasesize);
+		STATS_END(STAT_READ, t0, mi.erasesize, blockoff);
+		if (ret < 0)
+			return 0;
+	}
+
+	for (page = 0; page < block_pages; page++) {
+		if (page < first || page >= last ||
+				(page_skip && page_skip[page]) ||
+				(page_blank && page_blank[page])) {
+			if (!erase_mode)
+				continue;
+			want = NULL;
+		} else if (genecc) {
+			want = raw_page(page);
 		} else {
-			ERR("genecc with unknown layout!\n");
-			return -EINVAL;
+			want = &block_buf[page * img_page_sz];
 		}
-		writeme = do_genecc(srcdata, layout);	// page data + OOB
-	} else {
-		writeme = srcdata;				// page data only
+
+		if (raw) {
+			off = blockoff + page * mi.writesize;
+			if (read_raw_page(off, readback_buf) < 0)
+				return 0;
+			got = readback_buf;
+		} else {
+			got = &readback_buf[page * mi.writesize];
+		}
+
+		if (want && memcmp(got, want, raw_sz) != 0)
+			return 0;
+		if (!want && !ffscan_is_ff(got, raw_sz))
+			return 0;
 	}
+	return 1;
+}
 
-	DBG("0x%lx (#%-2d of block)\n", pageoff, pagenum);
+/*
+ * --verify: read back pages [first, last) of the block just written, raw,
+ * and decode them with the software RS decoder as the boot ROM would, then
+ * compare them with src, the raw pages that were written (src[0] is page
+ * first). With 5 or more bad symbols the decoder can miscorrect a subpage
+ * to another codeword, which only the compare catches.
+ * Pages left unprogrammed are not looked at. Returns 0, or -1 if a subpage
+ * is uncorrectable, needed more than verify_max bits corrected or does not
+ * match what was written.
+ */
+int verify_block(long long blockoff, int first, int last,
+		const unsigned char *src)
+{
+	int nsub = mi.writesize / 512;
+	int page, run, n, f, ret = 0;
+	STATS_VAR(t0);
+
+	if (first >= last)
+		return 0;
+	STATS_BEGIN(t0);
+	ret = dev->read_raw_run(blockoff + first * mi.writesize, verify_buf,
+			last - first);
+	STATS_END(STAT_READ, t0, (last - first) * genecc_page_raw,
+			blockoff + first * mi.writesize);
+	if (ret < 0) {
+		fprintf(stderr, "Verify read at 0x%llx failed\n", blockoff);
+		return -1;
+	}
 
-	if (lseek(mtd_fd, pageoff, SEEK_SET) != pageoff) {
-		perror("Write seek");
-		return -errno;
+	for (page = first; page < last; page += run) {
+		if ((page_skip && page_skip[page]) ||
+				(page_blank && page_blank[page])) {
+			run = 1;
+			continue;
+		}
+		for (run = 1; page + run < last &&
+				!(page_skip && page_skip[page + run]) &&
+				!(page_blank && page_blank[page + run]); run++)
+			;
+		genecc_check(&verify_buf[(page - first) * genecc_page_raw], run,
+				genecc_layout, verify_flips);
+
+		for (n = 0; n < run * nsub; n++) {
+			f = verify_flips[n];
+			verify_hist[f < 0 ? VERIFY_HIST - 1 :
+				f < VERIFY_HIST - 2 ? f : VERIFY_HIST - 2]++;
+			if (f == 0)
+				continue;
+			if (f < 0)
+				fprintf(stderr, "Verify 0x%llx subpage %d: uncorrectable\n",
+						blockoff + (page + n / nsub) * mi.writesize, n % nsub);
+			else if (!quiet)
+				printf("Verify 0x%llx subpage %d: %d bitflips\n",
+						blockoff + (page + n / nsub) * mi.writesize, n % nsub,
+						f);
+			if (f < 0 || f > verify_max)
+				ret = -1;
+		}
+
+		for (n = page; n < page + run; n++) {
+			if (memcmp(&verify_buf[(n - first) * genecc_page_raw],
+						&src[(n - first) * genecc_page_raw],
+						genecc_page_raw) != 0) {
+				fprintf(stderr, "Verify 0x%llx: differs from the data "
+						"written after correction\n",
+						blockoff + n * mi.writesize);
+				ret = -1;
+			}
+		}
 	}
+	return ret;
+}
+
+/*
+ * Write a run of pages from block_buf with one device call: in-band pages,
+ * or with --raw-input data + OOB records programmed raw.
+ * On failure *failed is set to the first page not known to be written.
+ */
+int write_page_run(long long blockoff, int first, int npages, int *failed)
+{
+	unsigned char *buf;
+	long long off;
+	int done, ret;
+	STATS_VAR(t0);
+
+	off = blockoff + first * mi.writesize;
+	buf = &block_buf[first * img_page_sz];
 
-	ret = write(mtd_fd, writeme, mi.writesize);
-	if (ret != mi.writesize) {
-		perror("Write page");
-		return -errno;
+	DBG("0x%llx (#%-2d of block) %d pages\n", off, first, npages);
+
+	STATS_BEGIN(t0);
+	if (raw_input) {
+		ret = dev->write_raw_run(off, buf, npages, &done);
+		if (ret < 0)
+			*failed = first + done;
+	} else {
+		ret = dev->write(off, buf, npages * mi.writesize, &done);
+		if (ret < 0)
+			*failed = first + done / mi.writesize;
 	}
+	STATS_END(STAT_PROGRAM, t0, npages * mi.writesize, off);
+	return ret;
+}
 
-	if (genecc) {
-		struct mtd_oob_buf oob;
+/*
+ * --ubi, --skip-blank: note which pages of block_buf need not be
+ * programmed. --ubi goes by the page data: UBI only writes after the last
+ * page it finds written, and reads erased pages as FF anyway, so any data
+ * FF page may be left erased. --skip-blank goes by the whole raw record,
+ * programming which would change nothing.
+ * Sparse don't care pages are already known, they are not scanned.
+ */
+void map_blank_pages(void)
+{
+	int len = ubi ? mi.writesize : img_page_sz;
+	int page;
+
+	if (!page_skip) {
+		ffscan_pages(block_buf, img_page_sz, len, block_pages, page_blank);
+		return;
+	}
+	for (page = 0; page < block_pages; page++)
+		page_blank[page] = !page_skip[page] &&
+			ffscan_is_ff(&block_buf[page * img_page_sz], len);
+}
 
-		oob.start = pageoff;
-		oob.length = mi.oobsize;
-		oob.ptr = writeme + mi.writesize;
+/*
+ * Ready to write next block (for writing) or have read a block (reading).
+ * Image file i/o is done ahead by the reader thread, take its next block.
+ * Returns -1 at the end of a stream read up to EOF.
+ */
+int next_image_block(void)
+{
+	long long len;
+	STATS_VAR(t0);
 
-		DBG("OOB\n");
-		if (ioctl(mtd_fd, MEMWRITEOOB, &oob) != 0) {
-			perror("Write OOB");
-			return -errno;
+	if (write_mode) {
+		STATS_BEGIN(t0);
+		block_buf = imgread_next();
+		STATS_END(STAT_IMAGE, t0, block_buf ? block_pages * img_page_sz : 0,
+				-1);
+		page_skip = imgread_skip_map();
+		len = to_eof ? imgread_length() : -1;
+		if (!block_buf && len >= 0)
+			return -1;
+		if (!block_buf)
+			exit(EXIT_FAIL);	// reader has reported why
+		// the first block starts start_off's page offset into the block
+		cache_page0 = (long long)img_block++ * block_pages -
+			(start_off & (mi.erasesize - 1)) / mi.writesize;
+		if (len >= 0) {
+			// the end is in sight: now we know how much to write
+			if (raw_input)
+				len = (len + img_page_sz - 1) / img_page_sz * mi.writesize;
+			req_length = len;
 		}
+		if (page_blank)
+			map_blank_pages();
 	}
 	return 0;
 }
 
 /*
- * Ready to write next block (for writing) or have read a block (reading).
- * Do needed image file i/o
+ * --ecc-cache: look the image up in the cache by its data, before any ECC
+ * is generated. Only a plain image file can be hashed up front.
  */
-int next_image_block(void)
+void open_ecc_cache(const struct stat *st)
 {
-	int buf_start;	// index of first image data
-	int buf_end;	// index of last image data + 1
-	int want_sz, read_sz;
+	void *image;
 	int ret;
 
-	if (write_mode) {
-		// first block, non-first page?
-		if (start_off > block_off) {
-			buf_start = start_off - block_off;
-			memset(block_buf, 0xFF, buf_start);
+	if (!S_ISREG(st->st_mode) || decompress || sparse || req_length <= 0) {
+		fprintf(stderr, "ECC cache needs an uncompressed image file, "
+				"not used\n");
+		return;
+	}
+	image = mmap(NULL, req_length, PROT_READ, MAP_SHARED, image_fd, 0);
+	if (image == MAP_FAILED) {
+		perror("ECC cache: mapping image");
+		return;
+	}
+	ret = ecccache_open(ecc_cache_dir, image, req_length, genecc_layout,
+			mi.writesize, genecc_page_raw);
+	munmap(image, req_length);
+
+	if (ret > 0) {
+		cache_raw = ecccache_pages();
+		if (!quiet)
+			printf("ECC cache hit\n");
+	} else if (ret == 0) {
+		cache_store = 1;
+	}
+	atexit(ecccache_close);
+}
+
+/*
+ * --ecc-cache miss: put the image pages of the current block in the new
+ * entry, once its ECC is all done. Call before the block is replaced.
+ */
+void store_cache_block(void)
+{
+	long long first, last;
+	int page;
+
+	if (!img_block)
+		return;
+	first = cache_page0 < 0 ? -cache_page0 : 0;
+	last = req_pages - cache_page0;
+	if (last > block_pages)
+		last = block_pages;
+	for (page = first; page < last; page++)
+		eccpool_page(page);
+	if (first < last)
+		ecccache_put(cache_page0 + first, block_raw + first * genecc_page_raw,
+				last - first);
+}
+
+/*
+ * Return number of pages at the end of block_buf with all FF page data,
+ * from the blank map. Sparse don't care pages are FF too.
+ */
+int count_trailing_ff_pages(void)
+{
+	int ffpages, page;
+
+	for (ffpages = 0; ffpages < block_pages; ffpages++) {
+		page = block_pages - ffpages - 1;
+		if (!(page_skip && page_skip[page]) && !page_blank[page])
+			break;
+	}
+
+	DBG("%d trailing FF pages\n", ffpages);
+
+	return ffpages;
+}
+
+/*
+ * -r: read [start_off, start_off + req_length) into image_fd, through the
+ * writer thread so output overlaps device reads. Bad blocks are skipped
+ * like writing skips them, or with --padbad output in place. Returns the
+ * exit code.
+ */
+int read_image(void)
+{
+	unsigned char *buf;
+	int start_page_num, npages, page, len, ret;
+	long long pages_left;
+	STATS_VAR(t0);
+
+	if (imgwrite_start(image_fd, block_pages * img_page_sz) < 0) {
+		fprintf(stderr, "Image writer start failed\n");
+		exit(EXIT_FAIL);
+	}
+
+	for (block_off = BLOCK_START(start_off); bytes_done < req_length;
+			block_off += mi.erasesize) {
+		if (block_off >= max_off) {
+			if (to_end)
+				break;
+			dump_stats();
+			fprintf(stderr, "Image does not fit below max offset\n");
+			exit(EXIT_NOSPACE);
+		}
+
+		if (start_off > block_off)
+			start_page_num = (start_off - block_off) / mi.writesize;
+		else
+			start_page_num = 0;
+		pages_left = (req_length - bytes_done + mi.writesize - 1) /
+			mi.writesize;
+		npages = block_pages - start_page_num;
+		if (npages > pages_left)
+			npages = pages_left;
+
+		buf = imgwrite_buf();
+		if (!buf)
+			exit(EXIT_FAIL);	// writer has reported why
+
+		if (block_is_bad(block_off)) {
+			fprintf(stderr, "Bad block at 0x%llx : ", block_off);
+			TRACE_MARK("bad block", block_off);
+			if (failbad) {
+				fprintf(stderr, "ABORT\n");
+				exit(EXIT_BADBLOCK);
+			}
+			bad_blocks_read++;
+			if (!pad_bad) {
+				fprintf(stderr, "skip\n");
+				continue;
+			}
+			fprintf(stderr, "pad\n");
+			memset(buf, 0xff, npages * img_page_sz);
+			// the factory marker, as filedev and the chip keep it
+			if (read_oob && start_page_num == 0)
+				buf[mi.writesize] = 0;
 		} else {
-			buf_start = 0;
+			if (!quiet)
+				printf("Read block at 0x%llx\n", block_off);
+			STATS_BEGIN(t0);
+			if (read_oob)
+				ret = dev->read_raw_run(block_off +
+						start_page_num * mi.writesize, buf, npages);
+			else
+				ret = dev->read(block_off + start_page_num * mi.writesize,
+						buf, npages * mi.writesize);
+			STATS_END(STAT_READ, t0, npages * img_page_sz,
+					block_off + start_page_num * mi.writesize);
+			if (ret < 0) {
+				fprintf(stderr, "Read block at 0x%llx failed\n", block_off);
+				exit(EXIT_FAIL);
+			}
 		}
-		// last block, not full?
-		if (bytes_done + mi.erasesize > req_length) {
-			buf_end = req_length - bytes_done + buf_start;
-			memset(&block_buf[buf_end], 0xff, mi.erasesize - buf_end);
+
+		// a partial last page is output whole with --oob
+		page = npages * mi.writesize;
+		if (bytes_done + page > req_length)
+			page = req_length - bytes_done;
+		len = read_oob ? npages * img_page_sz : page;
+		if (imgwrite_put(len) < 0)
+			exit(EXIT_FAIL);
+		bytes_done += page;
+	}
+
+	if (imgwrite_stop() < 0)
+		return EXIT_FAIL;
+	if (close(image_fd) != 0) {
+		perror(image_path);
+		return EXIT_FAIL;
+	}
+	image_fd = -1;
+
+	if (!quiet) {
+		printf("Read 0x%llx bytes\n", bytes_done);
+		if (bad_blocks_read)
+			printf("%d bad blocks %s\n", bad_blocks_read,
+					pad_bad ? "padded" : "skipped");
+		printf("Waited %.3f s for output\n", imgwrite_wait_time());
+	}
+	return EXIT_OK;
+}
+
+/*
+ * --copies: where the copy of nblocks image blocks goes, looking from
+ * block offset from. With --copies-contig a copy is nblocks good blocks in
+ * a row, as the RBL reads it, so it starts after the last bad block in its
+ * way; else bad blocks are skipped as when writing once, or with --failbad
+ * one is fatal. last_pages is the number of pages written to the last
+ * block. Returns the copy's first block, with *end just past its last, or
+ * -1 if it does not fit below max_off.
+ */
+long long place_copy(long long from, int nblocks, int last_pages,
+		long long *end)
+{
+	long long first = from, off, top;
+	int good = 0;
+
+	for (off = from; good < nblocks; off += mi.erasesize) {
+		if (off >= max_off)
+			return -1;
+		if (!block_is_bad(off)) {
+			good++;
+		} else if (failbad) {
+			fprintf(stderr, "Bad block at 0x%llx : ABORT\n", off);
+			exit(EXIT_BADBLOCK);
+		} else if (copies_contig) {
+			good = 0;
+			first = off + mi.erasesize;
+		}
+	}
+
+	// the last block is erased whole, or written up to the last page
+	top = erase_mode ? off : off - mi.erasesize + last_pages * mi.writesize;
+	if (top > max_off)
+		return -1;
+	*end = off;
+	return first;
+}
+
+/* --copies: program npages pages of copy_buf to a block in one call */
+int write_copy_block(long long blockoff, const unsigned char *buf,
+		int npages)
+{
+	int done, ret;
+	STATS_VAR(t0);
+
+	STATS_BEGIN(t0);
+	if (genecc || raw_input)
+		ret = dev->write_raw_run(blockoff, buf, npages, &done);
+	else
+		ret = dev->write(blockoff, buf, npages * mi.writesize, &done);
+	STATS_END(STAT_PROGRAM, t0, npages * mi.writesize, blockoff);
+	return ret;
+}
+
+/*
+ * --copies-contig: a block of the copy written to [first, end) failed and
+ * the copy moves on. Erase what was written of it, so a header the RBL
+ * could find is not left behind, and take it off the counts.
+ */
+static void abandon_copy(long long first, long long end, int nblocks,
+		int last_pages)
+{
+	long long off;
+	int i;
+
+	for (off = first, i = 0; off < end && i < nblocks; off += mi.erasesize) {
+		if (block_is_bad(off))
+			continue;
+		TRACE_MARK("copy abandoned", off);
+		if (erase_block(off) < 0) {
+			fprintf(stderr, "Erase block at 0x%llx failed: ", off);
+			retire_block(off);
+		}
+		blocks_written--;
+		bytes_done -= (long long)(i < nblocks - 1 ? block_pages :
+				last_pages) * mi.writesize;
+		i++;
+	}
+}
+
+/*
+ * --copies: read the image and generate its raw pages once, into copy_buf,
+ * then erase and program them into each copy's blocks in turn, so n copies
+ * cost one image pass plus n times the erase + program time. Where the
+ * copies go is checked first, before anything is written. A block that
+ * fails is marked bad: the copy carries on in the next good block, or with
+ * --copies-contig starts again after it, or with --failbad the run fails.
+ * Returns the exit code.
+ */
+int write_copies(void)
+{
+	long long from, first, end, off, sz;
+	int nblocks, last_pages, page_sz, npages, c, i, ret;
+
+	nblocks = (req_pages + block_pages - 1) / block_pages;
+	last_pages = req_pages - (long long)(nblocks - 1) * block_pages;
+	page_sz = genecc ? genecc_page_raw : img_page_sz;
+	sz = (long long)page_sz * block_pages;
+
+	// plan all copies against the known bad blocks
+	from = BLOCK_START(start_off);
+	for (c = 0; c < copies; c++) {
+		first = place_copy(from, nblocks, last_pages, &end);
+		if (first < 0) {
+			dump_stats();
+			fprintf(stderr, "%d copies would exceed max offset limit\n",
+					copies);
+			exit(EXIT_NOSPACE);
+		}
+		from = first + (long long)copy_stride * mi.erasesize;
+		if (from < end)
+			from = end;
+	}
+
+	if (cache_raw) {
+		// block aligned, the cached pages are laid out as copy_buf's
+		copy_buf = (unsigned char *)cache_raw;
+	} else {
+		copy_buf = malloc(sz * nblocks);
+		if (!copy_buf) {
+			fprintf(stderr, "copy_buf malloc failed\n");
+			exit(EXIT_FAIL);
+		}
+	}
+	for (i = 0; !cache_raw && i < nblocks; i++) {
+		if (genecc)
+			eccpool_cancel();
+		next_image_block();
+		if (genecc) {
+			// the workers lay the raw pages out straight into copy_buf
+			eccpool_submit(block_buf, copy_buf + i * sz, block_pages);
+			for (c = 0; c < block_pages; c++)
+				eccpool_page(c);
 		} else {
-			buf_end = mi.erasesize;
+			memcpy(copy_buf + i * sz, block_buf, sz);
 		}
+		if (cache_store)
+			ecccache_put((long long)i * block_pages, copy_buf + i * sz,
+					i < nblocks - 1 ? block_pages : last_pages);
+	}
+	if (cache_store && ecccache_commit() == 0 && !quiet)
+		printf("ECC cache entry written\n");
+
+	from = BLOCK_START(start_off);
+	for (c = 0; c < copies; c++) {
+		first = place_copy(from, nblocks, last_pages, &end);
+		if (first < 0) {
+			// blocks marked bad since the plan
+			dump_stats();
+			fprintf(stderr, "Copy %d would exceed max offset limit\n", c);
+			exit(EXIT_NOSPACE);
+		}
+		if (!quiet)
+			printf("Copy %d at 0x%llx\n", c, first);
 
-		want_sz = buf_end - buf_start;
-		read_sz = 0;
-		DBG("want %d bytes\n", want_sz);
-		while (read_sz < want_sz) {
-			ret = read(image_fd, &block_buf[buf_start + read_sz],
-					want_sz - read_sz);
+		for (off = first, i = 0; i < nblocks; off += mi.erasesize) {
+			block_off = off;
+			if (off >= max_off) {
+				// pushed on by blocks that failed
+				dump_stats();
+				fprintf(stderr, "Copy %d does not fit below max offset\n", c);
+				exit(EXIT_NOSPACE);
+			}
+			if (block_is_bad(off)) {
+				// marked since the plan; not with --copies-contig, which
+				// moves the copy when it marks one
+				fprintf(stderr, "Bad block at 0x%llx : ", off);
+				TRACE_MARK("bad block", off);
+				if (failbad) {
+					fprintf(stderr, "ABORT\n");
+					exit(EXIT_BADBLOCK);
+				}
+				fprintf(stderr, "skip\n");
+				bad_skipped++;
+				continue;
+			}
+			TRACE_MARK("block", off);
+			npages = i < nblocks - 1 ? block_pages : last_pages;
+
+			if (erase_mode && skip_erased && block_erased(off)) {
+				erases_avoided++;
+				TRACE_MARK("erase avoided", off);
+				ret = 0;
+			} else if (erase_mode) {
+				ret = erase_block(off);
+			} else {
+				ret = 0;
+			}
+			if (ret < 0)
+				fprintf(stderr, "Erase block at 0x%llx failed: ", off);
 			if (ret == 0) {
-				fprintf(stderr, "Unexpected EOF reading input file\n");
-				exit(EXIT_FAIL);
+				ret = write_copy_block(off, copy_buf + i * sz, npages);
+				if (ret < 0)
+					fprintf(stderr, "Write block at 0x%llx failed: ", off);
+			}
+			if (ret == 0 && verify &&
+					verify_block(off, 0, npages, copy_buf + i * sz) < 0) {
+				fprintf(stderr, "Verify block at 0x%llx failed: ", off);
+				ret = -1;
+			}
+
+			if (ret < 0 && copies_contig && !failbad) {
+				fprintf(stderr, "Mark bad, copy %d moves past it\n", c);
+				drop_block(off);
+				abandon_copy(first, off, nblocks, last_pages);
+				first = place_copy(off + mi.erasesize, nblocks, last_pages,
+						&end);
+				if (first < 0) {
+					dump_stats();
+					fprintf(stderr, "Copy %d would exceed max offset "
+							"limit\n", c);
+					exit(EXIT_NOSPACE);
+				}
+				if (!quiet)
+					printf("Copy %d at 0x%llx\n", c, first);
+				// the loop steps to first
+				off = first - mi.erasesize;
+				i = 0;
+				continue;
 			} else if (ret < 0) {
-				perror("Reading image file");
-				exit(EXIT_FAIL);
+				retire_block(off);
+				continue;
 			}
-			DBG("read 0x%x (%d) bytes\n", ret, ret);
-			read_sz += ret;
+
+			blocks_written++;
+			bytes_done += (long long)npages * mi.writesize;
+			i++;
 		}
+
+		from = first + (long long)copy_stride * mi.erasesize;
+		if (from < off)
+			from = off;
 	}
-	return 0;
+
+	if (!quiet)
+		printf("%d copies written\n", copies);
+	return EXIT_OK;
 }
 
-/* Return number of pages at the end of block_buf which are all FFs */
-int count_trailing_ff_pages(void)
+#ifdef HAVE_STATS
+/* --stats: the summary is written at exit, whatever the exit code */
+static void write_stats(void)
 {
-	int ffs, ffpages;
-
-	ffs = 0;
-	while (ffs < mi.erasesize && block_buf[(mi.erasesize - ffs) - 1] == 0xff) {
-		++ffs;
-	}
-	ffpages = ffs / mi.writesize;
-
-	DBG("0x%x FFs = %d trailing pages\n", ffs, ffpages);
+	stats_counter("blocks_written", blocks_written);
+	stats_counter("blocks_unchanged", blocks_unchanged);
+	stats_counter("erases_avoided", erases_avoided);
+	stats_counter("bad_blocks_skipped", bad_skipped + bad_blocks_read);
+	stats_counter("blocks_marked_bad", marked_bad);
+	stats_counter("dont_care_pages_skipped", pages_skipped);
+	stats_counter("blank_pages_skipped", blank_skipped);
+	stats_dump(stats_path, bytes_done);
+}
 
-	return ffpages;
+static void write_trace(void)
+{
+	trace_dump(trace_path);
 }
+#endif
 
 int main(int argc, char *argv[])
 {
@@ -388,78 +1494,171 @@ int main(int argc, char *argv[])
 	int rewind;		// bad block, write the same data in next block
 
 	handle_options(argc, argv);
+#ifdef HAVE_STATS
+	if (stats_path) {
+		stats_start();
+		atexit(write_stats);
+	}
+	if (trace_path) {
+		trace_start(trace_events);
+		TRACE_THREAD("main");
+		atexit(write_trace);
+	}
+#endif
+	ffscan_init();
 
-	if (legacy || dm365_rbl)
+	if (legacy) {
 		genecc = 1;
-	else
+		genecc_layout = GENECC_LAYOUT_LEGACY;
+	} else if (dm365_rbl) {
+		genecc = 1;
+		genecc_layout = GENECC_LAYOUT_DM365_RBL;
+	} else {
 		genecc = 0;
-
-	if ((mtd_fd = open(mtd_path, O_RDWR)) == -1) {
-		perror(mtd_path);
-		exit(EXIT_FAIL);
 	}
 
-	if (ioctl(mtd_fd, MEMGETINFO, &mi) != 0) {
-		perror("MEMGETINFO");
-		close(mtd_fd);
+	if (file_geometry)
+		dev = filedev_open(mtd_path, file_geometry, badblock_list, &mi);
+	else
+		dev = mtddev_open(mtd_path,
+				(write_mode && (genecc || raw_input) ? MTDDEV_RAW : 0) |
+				(read_oob ? MTDDEV_RAW : 0) |
+				(read_mode ? MTDDEV_RDONLY : 0) |
+				(no_memwrite ? MTDDEV_NO_MEMWRITE : 0), &mi);
+	if (!dev)
 		exit(EXIT_FAIL);
-	}
+	dev_size = dev->size();
 
-	// Right now, only support one expected NAND size
-	if (mi.oobsize != 64) {
-		fprintf(stderr, "oobsize %d not supported\n", mi.oobsize);
-		exit(EXIT_FAIL);
-	}
-	if (mi.writesize != 2048) {
-		fprintf(stderr, "writesize %d not supported\n", mi.writesize);
+	// the OOB layouts need 16 bytes of OOB per 512 byte subpage
+	if (genecc && genecc_set_geometry(mi.writesize, mi.oobsize) < 0) {
+		fprintf(stderr, "Page size %d + %d not supported by OOB layout\n",
+				mi.writesize, mi.oobsize);
 		exit(EXIT_FAIL);
 	}
 
 	if (start_off & (mi.writesize - 1)) {
 		fprintf(stderr, "Start offset must be aligned to page size 0x%x\n",
 				mi.writesize);
-		close(mtd_fd);
+		dev->close();
+		exit(EXIT_FAIL);
+	}
+
+	// a copy is whole blocks, each starting where the RBL looks
+	if (copies > 1 && (start_off & (mi.erasesize - 1))) {
+		fprintf(stderr, "With --copies, start offset must be aligned to "
+				"block size 0x%x\n", mi.erasesize);
+		dev->close();
 		exit(EXIT_FAIL);
 	}
 
+	block_pages = mi.erasesize / mi.writesize;
+	img_page_sz = mi.writesize + (raw_input || read_oob ? mi.oobsize : 0);
+
 	if (write_mode) {
-		image_fd = open(image_path, O_RDONLY);
-		if (image_fd == -1) {
+		struct stat st;
+
+		if (!strcmp(image_path, "-"))
+			image_fd = dup(STDIN_FILENO);
+		else
+			image_fd = open(image_path, O_RDONLY);
+		if (image_fd == -1 || fstat(image_fd, &st) != 0) {
 			perror(image_path);
 			exit(EXIT_FAIL);
 		}
-		input_size = lseek(image_fd, 0, SEEK_END);
-		lseek(image_fd, 0, SEEK_SET);
 
-		if (req_length < 0) {
+		if (decompress) {
+			if (decomp_open(image_fd, decompress) < 0)
+				exit(EXIT_FAIL);
+			// decoded in the reader thread, ahead of the writer
+			imgread_set_read(decomp_read);
+		}
+
+		if (sparse) {
+			// the header has the length, whatever the input is
+			input_size = imgread_set_sparse(image_fd, img_page_sz);
+			if (input_size < 0)
+				exit(EXIT_FAIL);
+		} else if (decompress || !S_ISREG(st.st_mode)) {
+			/*
+			 * Pipe, FIFO, socket, compressed: can't size it first. The
+			 * reader takes blocks as they come; the length is -l or found
+			 * at EOF.
+			 */
+			input_size = -1;
+			to_eof = req_length < 0;
+			DBG("streaming input%s\n", to_eof ? " up to EOF" : "");
+		} else {
+			input_size = st.st_size;
+		}
+
+		if (input_size < 0) {
+			// nothing to check here
+		} else if (raw_input) {
+			// from here on sizes are of the page data
+			if (input_size % (mi.writesize + mi.oobsize)) {
+				fprintf(stderr, "Raw image is not a whole number of "
+						"%d + %d byte pages\n", mi.writesize, mi.oobsize);
+				exit(EXIT_FAIL);
+			}
+			input_size = input_size / (mi.writesize + mi.oobsize) *
+				mi.writesize;
+		}
+
+		if (input_size < 0) {
+			// streamed, nothing to check against
+		} else if (req_length < 0) {
 			req_length = input_size;
 		} else if (req_length > input_size) {
-			fprintf(stderr, "File smaller (%d) than requested length (%d)\n",
-					(int)input_size, req_length);
+			fprintf(stderr, "File smaller (%lld) than requested length "
+					"(%lld)\n", input_size, req_length);
 			exit(EXIT_FAIL);
 		}
-		DBG("input_size: %d\n", (int)input_size);
+		DBG("input_size: %lld\n", input_size);
+
+		if (ecc_cache_dir)
+			open_ecc_cache(&st);
+	} else if (read_mode) {
+		if (!strcmp(image_path, "-"))
+			image_fd = dup(STDOUT_FILENO);
+		else
+			image_fd = open(image_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (image_fd == -1) {
+			perror(image_path);
+			exit(EXIT_FAIL);
+		}
+		to_end = req_length < 0;
 	}
 
-	if (req_length < 0) {
+	if (req_length < 0 && !to_eof && !to_end) {
 		fprintf(stderr, "Must specify length or supply an input file\n");
 		exit(EXIT_FAIL);
 	}
 
-	req_pages = (((req_length - 1) / mi.writesize) + 1);
-	block_pages = mi.erasesize / mi.writesize;
+	if (copies > 1 && to_eof) {
+		fprintf(stderr, "--copies needs the image length, use -l\n");
+		exit(EXIT_FAIL);
+	}
 
 	if (max_off < 0) {
-		max_off = mi.size;
+		max_off = dev_size;
 	} else {
-		if (max_off > mi.size) {
-			max_off = mi.size;
-			fprintf(stderr, "Max offset truncated to device size: 0x%x\n",
+		if (max_off > dev_size) {
+			max_off = dev_size;
+			fprintf(stderr, "Max offset truncated to device size: 0x%llx\n",
 					max_off);
 		}
 	}
 
-	if (req_pages * mi.writesize > mi.size - start_off) {
+	/*
+	 * Up to EOF, plan for all the space there is. The main loop sets the
+	 * real length when the reader gets to the end of the stream.
+	 */
+	if (to_eof || to_end)
+		req_length = max_off - start_off;
+
+	req_pages = (((req_length - 1) / mi.writesize) + 1);
+
+	if (req_pages * mi.writesize > dev_size - start_off) {
 		dump_stats();
 		fprintf(stderr, "Request would pass the end of device\n");
 		exit(EXIT_NOSPACE);
@@ -473,60 +1672,197 @@ int main(int argc, char *argv[])
 
 	if (write_mode)  {
 		if (genecc) {
-			ret = ioctl(mtd_fd, MTDFILEMODE, (void *) MTD_MODE_RAW);
-			if (ret != 0) {
-				perror ("MTDFILEMODE");
-				close (mtd_fd);
-				exit (EXIT_FAIL);
-			} else {
-				DBG("Set MTD_MODE_RAW\n");
-			}
 			genecc_init();
+
+			block_raw = malloc(genecc_page_raw * block_pages);
+			if (!block_raw) {
+				fprintf(stderr, "block_raw malloc failed\n");
+				exit(EXIT_FAIL);
+			}
+
+			if (ecc_threads < 0)
+				ecc_threads = sysconf(_SC_NPROCESSORS_ONLN);
+			// with the pages cached there is no ECC to generate
+			if (!cache_raw && eccpool_start(ecc_threads, genecc_layout,
+						block_pages) < 0) {
+				fprintf(stderr, "ECC worker start failed\n");
+				exit(EXIT_FAIL);
+			}
+		}
+		if (ubi || skip_blank) {
+			page_blank = malloc(block_pages);
+			if (!page_blank) {
+				fprintf(stderr, "page_blank malloc failed\n");
+				exit(EXIT_FAIL);
+			}
+		}
+		/*
+		 * block_buf comes from the reader's ring of image block buffers,
+		 * or straight from the mapped image file. With raw input a block
+		 * is block_pages records, and a partial last page is whole.
+		 */
+		if (imgread_start(image_fd, block_pages * img_page_sz,
+					(start_off & (mi.erasesize - 1)) / mi.writesize * img_page_sz,
+					to_eof ? -1 :
+					raw_input ? req_pages * img_page_sz : req_length,
+					!no_mmap) < 0) {
+			fprintf(stderr, "Image reader start failed\n");
+			exit(EXIT_FAIL);
+		}
+	}
+
+	if (verify) {
+		verify_buf = malloc(block_pages * genecc_page_raw);
+		verify_flips = malloc(block_pages * (mi.writesize / 512) *
+				sizeof(*verify_flips));
+		if (!verify_buf || !verify_flips) {
+			fprintf(stderr, "verify_buf malloc failed\n");
+			exit(EXIT_FAIL);
 		}
-		// allocate block buffer: in-band page size * pages per block
-		block_buf = malloc(mi.writesize * block_pages);
-		if (!block_buf) {
-			fprintf(stderr, "block_buf malloc failed\n");
+	}
+
+	if (diff_mode || skip_erased) {
+		readback_buf = malloc(mi.erasesize + mi.oobsize);
+		if (!readback_buf) {
+			fprintf(stderr, "readback_buf malloc failed\n");
 			exit(EXIT_FAIL);
 		}
 	}
 
+	scan_bad_blocks(BLOCK_START(start_off));
+
+	if (copies > 1) {
+		ret = write_copies();
+		if (genecc)
+			eccpool_stop();
+		imgread_stop();
+		dev->close();
+		if (copy_buf != cache_raw)
+			free(copy_buf);
+		return ret;
+	}
+
+	// up to EOF, only the per block max_off checks in the loop apply
+	if (!to_eof && !to_end && !(read_mode && pad_bad))
+		check_write_plan();
+
+	if (read_mode) {
+		ret = read_image();
+		dev->close();
+		return ret;
+	}
+
 	/*
 	 * Main write loop:
 	 */
 
 	rewind = 0;
 	// start at beginning of block containing start_off
-	for (block_off = start_off & ~(mi.erasesize - 1);
+	for (block_off = BLOCK_START(start_off);
 		bytes_done < req_length;
 		block_off += mi.erasesize
 	) {
-		int start_page_num, page_num;
-		int write_pages;
-		loff_t ll_off;
+		int start_page_num, page_num, fail_page;
+		int write_pages = 0, end_page = 0, run;
+		long long pages_left;
 
 		block_bytes_done = 0;
 
 		//dump_stats();
 
-		// check bad block. Have to pass a long long to ioctl.
-		ll_off = block_off;
-		ret = ioctl(mtd_fd, MEMGETBADBLOCK, &ll_off);
-		if (ret < 0) {
-			perror("MEMGETBADBLOCK");
-			exit(EXIT_FAIL);
+		/*
+		 * Get the image block first: a stream may turn out to have ended
+		 * exactly at the last block, and block_off be past the device.
+		 * It is held for the next good block.
+		 */
+		if (write_mode && !rewind) {
+			if (cache_store)
+				store_cache_block();
+			// workers may still be reading the old block_buf
+			if (genecc && !cache_raw)
+				eccpool_cancel();
+			if (next_image_block() < 0)
+				break;
+			/*
+			 * Workers fill block_raw while pages are programmed. On
+			 * rewind the block's raw pages are replayed as they are.
+			 */
+			if (genecc && !cache_raw)
+				eccpool_submit(block_buf, block_raw, block_pages);
 		}
-		if (ret == 1) {
-			fprintf(stderr, "Bad block at 0x%x : ", block_off);
+
+		// only up to EOF; otherwise check_write_plan() saw to it
+		if (block_off >= max_off) {
+			dump_stats();
+			fprintf(stderr, "Image does not fit below max offset\n");
+			exit(EXIT_NOSPACE);
+		}
+
+		// bad block status comes from the up-front scan
+		if (block_is_bad(block_off)) {
+			fprintf(stderr, "Bad block at 0x%llx : ", block_off);
+			TRACE_MARK("bad block", block_off);
 			if (failbad) {
 				fprintf(stderr, "ABORT\n");
 				exit(EXIT_BADBLOCK);
 			} else {
 				fprintf(stderr, "skip\n");
+				bad_skipped++;
+				rewind = write_mode;
+				continue;
+			}
+		}
+
+		if (start_off > block_off) {
+			// first block, starting later than page 0
+			start_page_num = (start_off - block_off) / mi.writesize;
+		} else {
+			start_page_num = 0;
+		}
+
+		if (write_mode) {
+			/*
+			 * UBI assumes it can write to any pages at the end of a PEB which
+			 * are all FFs in the in-band data area, so we must not write those
+			 * pages as we write (non-FF) ECC and UBI's later write would end
+			 * up with corrupt ECC (bitwise ANDed with ours).
+			 * FF pages before them are skipped too, see map_blank_pages().
+			 *
+			 * http://www.linux-mtd.infradead.org/doc/ubi.html#L_flasher_algo
+			 */
+			if (ubi)
+				write_pages = block_pages - count_trailing_ff_pages();
+			else
+				write_pages = block_pages;
+
+			// pages of this block needed to finish the image
+			pages_left = (req_length - bytes_done + mi.writesize - 1) /
+				mi.writesize;
+			if (pages_left > block_pages - start_page_num)
+				end_page = block_pages;
+			else
+				end_page = start_page_num + pages_left;
+
+			if (block_off + end_page * mi.writesize > max_off) {
+				fprintf(stderr, "Writing this page would exceed max offset\n");
+				dump_stats();
+				exit(EXIT_NOSPACE);
+			}
+
+			if (diff_mode && block_unchanged(block_off, start_page_num,
+						write_pages < end_page ? write_pages : end_page)) {
+				if (!quiet)
+					printf("Unchanged block at 0x%llx\n", block_off);
+				blocks_unchanged++;
+				TRACE_MARK("unchanged", block_off);
+				rewind = 0;
+				bytes_done += (end_page - start_page_num) * mi.writesize;
 				continue;
 			}
+			blocks_written++;
 		}
 
+		TRACE_MARK("block", block_off);
 		if (!quiet) {
 			if (erase_mode && write_mode)
 				printf("Erase + write");
@@ -536,7 +1872,7 @@ int main(int argc, char *argv[])
 				printf("Write");
 			else
 				exit(EXIT_FAIL);	// bug
-			printf(" block at 0x%x\n", block_off);
+			printf(" block at 0x%llx\n", block_off);
 		}
 
 		if (erase_mode) {
@@ -546,118 +1882,173 @@ int main(int argc, char *argv[])
 				exit(EXIT_NOSPACE);
 			}
 
-			ret = erase_block(block_off);
+			if (skip_erased && block_erased(block_off)) {
+				DBG("block at 0x%llx already erased\n", block_off);
+				erases_avoided++;
+				TRACE_MARK("erase avoided", block_off);
+				ret = 0;
+			} else {
+				ret = erase_block(block_off);
+			}
 			if (ret < 0) {
-				fprintf(stderr, "Erase block at 0x%x failed\n", block_off);
+				fprintf(stderr, "Erase block at 0x%llx failed\n", block_off);
 				if (mark_block_bad(block_off) < 0) {
 					fprintf(stderr, "Marking block bad failed\n");
 					// If not marked bad it would be misread, so this is fatal
 					exit(EXIT_FAIL);
 				} else {
+					// image block already read, write it to the next block
+					rewind = write_mode;
 					continue;	// try next block
 				}
 			}
 		}
 
-		if (start_off > block_off) {
-			// first block, starting later than page 0
-			start_page_num = (start_off - block_off) / mi.writesize;
-		} else {
-			start_page_num = 0;
-		}
-
-		if (write_mode) {
-			// don't read more image file if skipping a bad block
-			if (!rewind)
-				next_image_block();
-		} else {
+		if (!write_mode) {
 			// erasing, update count now
 			bytes_done += mi.erasesize - start_page_num * mi.writesize;
 			continue;
 		}
 
-		/*
-		 * UBI assumes it can write to any pages at the end of a PEB which
-		 * are all FFs in the in-band data area, so we must not write those
-		 * pages as we write (non-FF) ECC and UBI's later write would end up
-		 * with corrupt ECC (bitwise ANDed with ours).
-		 *
-		 * http://www.linux-mtd.infradead.org/doc/ubi.html#L_flasher_algo
-		 */
-		if (ubi)
-			write_pages = block_pages - count_trailing_ff_pages();
-		else
-			write_pages = block_pages;
-
 		if (!quiet && write_pages != block_pages)
 			printf("Skip last %d pages of block\n", block_pages - write_pages);
 
-		rewind = 0;
-		// foreach page in this block, until done
-		for (page_num = start_page_num; page_num < block_pages;	++page_num) {
+		// pages after write_pages are the UBI mode skip, counted as done
+		if (write_pages > end_page)
+			write_pages = end_page;
+		else
+			blank_skipped += end_page -
+				(write_pages > start_page_num ? write_pages : start_page_num);
 
-			if (block_off + (page_num + 1) * mi.writesize > max_off) {
-				fprintf(stderr, "Writing this page would exceed max offset\n");
-				dump_stats();
-				exit(EXIT_NOSPACE);
+		rewind = 0;
+		/*
+		 * foreach run of pages in this block: genecc pages go one at a time
+		 * as the ECC workers finish them, in-band and raw input pages all
+		 * in one write.
+		 */
+		for (page_num = start_page_num; page_num < write_pages;
+				page_num += run) {
+			// sparse image: don't care pages are left as they are
+			if (page_skip && page_skip[page_num]) {
+				run = 1;
+				pages_skipped++;
+				continue;
+			}
+			if (page_blank && page_blank[page_num]) {
+				run = 1;
+				blank_skipped++;
+				continue;
 			}
 
-			if (page_num >= write_pages) {
-				/*
-				 * Do the UBI mode skip here but stay in the loop so our "done"
-				 * counters get incremented appropriately
-				 */
-				DBG("Skipping page %d\n", page_num);
-				ret = 0;
-			} else {
+			if (genecc) {
+				run = 1;
 				ret = write_page(block_off, page_num);
+				fail_page = page_num;
+			} else {
+				run = write_pages - page_num;
+				if (page_skip || page_blank) {
+					for (run = 1; page_num + run < write_pages &&
+							!(page_skip && page_skip[page_num + run]) &&
+							!(page_blank && page_blank[page_num + run]);
+							run++)
+						;
+				}
+				ret = write_page_run(block_off, page_num, run, &fail_page);
 			}
 
 			if (ret < 0) {
-				fprintf(stderr, "Write block at 0x%x, page %d failed: ",
-						block_off, page_num);
-				if (failbad) {
-					fprintf(stderr, "ABORT\n");
-					exit(EXIT_BADBLOCK);
-				} else {
-					fprintf(stderr, "Mark bad and skip\n");
-				}
-
-				if (erase_block(block_off) < 0) {
-					fprintf(stderr, "Erase block at 0x%x failed\n", block_off);
-					// This isn't so important as we are about to mark bad
-				}
-				if (mark_block_bad(block_off) < 0) {
-					fprintf(stderr, "Marking block bad at 0x%x failed\n",
-							block_off);
-					// If not marked bad it would be misread, so this is fatal
-					exit(EXIT_FAIL);
-				}
+				fprintf(stderr, "Write block at 0x%llx, page %d failed: ",
+						block_off, fail_page);
+				retire_block(block_off);
 				rewind = 1;
 				break;
 			}
-
-			block_bytes_done += mi.writesize;
-			if (bytes_done + block_bytes_done >= req_length)
-				break;
+		}
+		if (!rewind && verify && start_page_num < write_pages &&
+				verify_block(block_off, start_page_num, write_pages,
+					raw_page(start_page_num)) < 0) {
+			fprintf(stderr, "Verify block at 0x%llx failed: ", block_off);
+			retire_block(block_off);
+			rewind = 1;
 		}
 		if (!rewind) {
+			block_bytes_done = (end_page - start_page_num) * mi.writesize;
 			bytes_done += block_bytes_done;
 		}
 	}
 
+	if (cache_store) {
+		store_cache_block();
+		if (bytes_done >= req_length && ecccache_commit() == 0 && !quiet)
+			printf("ECC cache entry written\n");
+	}
+	if (genecc && write_mode)
+		eccpool_stop();
+	if (write_mode)
+		imgread_stop();
+
+	if (!quiet) {
+		if (write_mode)
+			printf("Waited %.3f s for input\n", imgread_wait_time());
+		if (decompress) {
+			double rd, dec, full;
+
+			/*
+			 * The reader thread either waits on the writer (flash is the
+			 * limit) or is busy reading and decoding while the writer
+			 * waits on it.
+			 */
+			decomp_times(&rd, &dec);
+			full = imgread_full_time();
+			printf("Input: %.3f s reading, %.3f s decoding, %.3f s waiting "
+					"for flash\n", rd, dec, full);
+			printf("Bottleneck: %s\n", full >= imgread_wait_time() ? "flash" :
+					dec >= rd ? "decoder" : "input read");
+		}
+		if (diff_mode)
+			printf("%d blocks unchanged, %d rewritten\n",
+					blocks_unchanged, blocks_written);
+		if (skip_erased)
+			printf("%d erases avoided\n", erases_avoided);
+		if (sparse)
+			printf("%d don't care pages not programmed\n", pages_skipped);
+		if (ubi || skip_blank)
+			printf("%d blank pages not programmed\n", blank_skipped);
+		if (verify)
+			printf("Verify, subpages by bitflips: 0: %d, 1: %d, 2: %d, "
+					"3: %d, 4+: %d, uncorrectable: %d\n", verify_hist[0],
+					verify_hist[1], verify_hist[2], verify_hist[3],
+					verify_hist[4], verify_hist[5]);
+	}
+
+	if (decompress)
+		decomp_close();
 	if (image_fd != -1)
 		close(image_fd);
-	close(mtd_fd);
+	dev->close();
 
 	if (mtd_path)
 		free(mtd_path);
 	if (image_path)
 		free(image_path);
+	if (file_geometry)
+		free(file_geometry);
+	if (badblock_list)
+		free(badblock_list);
+	if (decompress)
+		free(decompress);
 	if (page_buf)
 		free(page_buf);
-	if (block_buf)
-		free(block_buf);
+	if (block_raw)
+		free(block_raw);
+	if (readback_buf)
+		free(readback_buf);
+	if (verify_buf)
+		free(verify_buf);
+	if (verify_flips)
+		free(verify_flips);
+	if (bad_map)
+		free(bad_map);
 
 	return 0;
 }
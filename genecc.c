@@ -17,13 +17,16 @@
 
 #include "debug.h"
 #include "genecc.h"
+#include "genecc_simd.h"
+#include "stats.h"
 
-const int subsz_raw = 512 + 16;
-const int subsz_data = 512;
-const int pagesz_data = 2048;
+const int subsz_raw = GENECC_SUBPAGE_DATA + GENECC_SUBPAGE_OOB;
+const int subsz_data = GENECC_SUBPAGE_DATA;
 
-// hardcode for the only sizing we care about, for now
-u8 mtd_raw_buf[2048 + 64];
+int genecc_page_data = 2048;
+int genecc_page_raw = 2048 + 64;
+int genecc_batch_pages = GENECC_BATCH_SUBPAGES / 4;
+static int page_oob = 64;
 
 /*
  * Reed-Solomon ECC code reverse-engineered from TI PSP flash_utils genecc
@@ -43,6 +46,11 @@ const bgfe primelement = 2;
 bgfe gp[2 * MAX_CORR_ERR + 1];	// generator poly
 bgfe alpha[LENGTH];				// 4KB
 s32  indx[LENGTH];				// 4KB
+u16  fbtab[LENGTH][2 * MAX_CORR_ERR];	// 16KB, feedback * gp[j]
+
+// vector parity backend, NULL for scalar
+static const struct genecc_backend *backend;
+static const u8 zero_subpage[K];
 
 bgfe alphafromindex(int i)
 {
@@ -102,6 +110,22 @@ bgfe modulo(bgfe x, bgfe y)
 	return x;
 }
 
+/* log/antilog table multiply, only valid after genecc_init() */
+static inline bgfe gf_mul(bgfe x, bgfe y)
+{
+	if (!x || !y)
+		return 0;
+	return alpha[(indx[x] + indx[y]) % (LENGTH - 1)];
+}
+
+/* x / y, y non-zero */
+static inline bgfe gf_div(bgfe x, bgfe y)
+{
+	if (!x)
+		return 0;
+	return alpha[(indx[x] + (LENGTH - 1) - indx[y]) % (LENGTH - 1)];
+}
+
 bgfe multiply(bgfe x, bgfe y)
 {
 	int i;
@@ -140,14 +164,61 @@ void genecc_init(void)
 		}
 		gp[0] = alphafromindex((i * (i + 1)) / 2);
 	}
+
+	for (i = 0; i < LENGTH; i++)
+		for (j = 0; j < 2 * MAX_CORR_ERR; j++)
+			fbtab[i][j] = gf_mul(i, gp[j]);
+
+	genecc_simd_init((const u16 (*)[8])fbtab);
+	for (backend = genecc_backends; backend->name; backend++)
+		if (backend->supported())
+			break;
+	if (!backend->name)
+		backend = NULL;
+	DBG("ECC backend: %s\n", genecc_backend_name());
+
+#ifdef _DEBUG
+	if (genecc_selftest() != 0)
+		ERR("BUG: ECC self test failed\n");
+#endif
 }
 
-void gen_subpage_ecc(const u8 *buf, u8 *ecc)
+/* pack 2*s (8) 10-bit parity symbols as 2 sets of 5*8 bits (NAND stored format) */
+static void pack_parity(const bgfe *p, u8 *ecc)
 {
-	bgfe data[N], *p;
-	int i, j;
 	u8 *e;
 
+	for (e = ecc; e < ecc + 10; p += 4) {
+		*e++ =   p[0]       & 0xff;
+		*e++ = ((p[0] >> 8) & 0x03) | ((p[1] << 2) & 0xfc);
+		*e++ = ((p[1] >> 6) & 0x0f) | ((p[2] << 4) & 0xf0);
+		*e++ = ((p[2] >> 4) & 0x3f) | ((p[3] << 6) & 0xc0);
+		*e++ =  (p[3] >> 2) & 0xff;
+	}
+}
+
+/* inverse of pack_parity() */
+static void unpack_parity(const u8 *ecc, bgfe *p)
+{
+	const u8 *e;
+
+	for (e = ecc; e < ecc + 10; e += 5, p += 4) {
+		p[0] =  e[0]       | ((e[1] & 0x03) << 8);
+		p[1] = (e[1] >> 2) | ((e[2] & 0x0f) << 6);
+		p[2] = (e[2] >> 4) | ((e[3] & 0x3f) << 4);
+		p[3] = (e[3] >> 6) |  (e[4] << 2);
+	}
+}
+
+/*
+ * Original bit-serial long division, kept as the reference the table-driven
+ * encoder is checked against.
+ */
+void gen_subpage_ecc_ref(const u8 *buf, u8 *ecc)
+{
+	bgfe data[N];
+	int i, j;
+
 	// things break if data is not cleared. Loop sets the rest.
 	memset(data, 0, 2 * S * sizeof(bgfe));
 
@@ -165,56 +236,453 @@ void gen_subpage_ecc(const u8 *buf, u8 *ecc)
 	}
 
 	// first 2*s (8) elements of data[] contain our parity
-	// pack as 2 sets of 5*8 bits (NAND stored format)
-	for (e = ecc, p = data; e < ecc + 10; p += 4) {
-		*e++ =   p[0]       & 0xff;
-		*e++ = ((p[0] >> 8) & 0x03) | ((p[1] << 2) & 0xfc);
-		*e++ = ((p[1] >> 6) & 0x0f) | ((p[2] << 4) & 0xf0);
-		*e++ = ((p[2] >> 4) & 0x3f) | ((p[3] << 6) & 0xc0);
-		*e++ =  (p[3] >> 2) & 0xff;
+	pack_parity(data, ecc);
+}
+
+/*
+ * Same division done as an LFSR, one table lookup per data byte.
+ * The remainder r[] shifts up one symbol per input byte and the feedback
+ * symbol (input ^ top of remainder, up to 10 bits) indexes fbtab[] for its
+ * products with every generator coefficient.
+ */
+static void lfsr_subpage(const u8 *buf, bgfe *r)
+{
+	bgfe r0 = 0, r1 = 0, r2 = 0, r3 = 0, r4 = 0, r5 = 0, r6 = 0, r7 = 0;
+	const u16 *fb;
+	int i;
+
+	for (i = 0; i < K; i++) {
+		fb = fbtab[buf[i] ^ r7];
+		r7 = r6 ^ fb[7];
+		r6 = r5 ^ fb[6];
+		r5 = r4 ^ fb[5];
+		r4 = r3 ^ fb[4];
+		r3 = r2 ^ fb[3];
+		r2 = r1 ^ fb[2];
+		r1 = r0 ^ fb[1];
+		r0 = fb[0];
 	}
+
+	r[0] = r0; r[1] = r1; r[2] = r2; r[3] = r3;
+	r[4] = r4; r[5] = r5; r[6] = r6; r[7] = r7;
 }
 
-unsigned char *do_genecc(const u8 *src, int layout)
+void gen_subpage_ecc(const u8 *buf, u8 *ecc)
+{
+	bgfe r[2 * S];
+
+	lfsr_subpage(buf, r);
+	pack_parity(r, ecc);
+}
+
+/*
+ * Parity for n subpages, src[i] -> ecc[i], using the selected vector
+ * backend for as many full sets of lanes as possible.
+ */
+static void gen_multi_ecc(const u8 *const *src, u8 *const *ecc, int n)
+{
+	u16 par[GENECC_MAX_LANES][8];
+	const u8 *lsrc[GENECC_MAX_LANES];
+	bgfe r[2 * S];
+	int i, j;
+
+	while (backend && n > 0) {
+		/*
+		 * A vector pass costs about the same as 2-3 scalar subpages, so
+		 * pad a short tail with a dummy subpage rather than go scalar.
+		 */
+		if (n < backend->lanes && n <= 2)
+			break;
+		for (i = 0; i < backend->lanes; i++)
+			lsrc[i] = i < n ? src[i] : zero_subpage;
+		backend->run(lsrc, par);
+		for (i = 0; i < backend->lanes && i < n; i++) {
+			for (j = 0; j < 2 * S; j++)
+				r[j] = par[i][j];
+			pack_parity(r, ecc[i]);
+		}
+		src += i;
+		ecc += i;
+		n -= i;
+	}
+
+	for (i = 0; i < n; i++)
+		gen_subpage_ecc(src[i], ecc[i]);
+}
+
+/*
+ * Select the parity backend by name ("scalar", "ssse3", "avx2", "neon").
+ * Returns -1 if it is not built in or not supported by this CPU.
+ */
+int genecc_set_backend(const char *name)
+{
+	const struct genecc_backend *b;
+
+	if (!strcmp(name, "scalar")) {
+		backend = NULL;
+		return 0;
+	}
+	for (b = genecc_backends; b->name; b++) {
+		if (!strcmp(name, b->name) && b->supported()) {
+			backend = b;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *genecc_backend_name(void)
+{
+	return backend ? backend->name : "scalar";
+}
+
+/*
+ * Parity of three fixed subpages (all FF, byte ramp, LCG noise) as produced
+ * by the original TI-derived code. Returns 0 if both encoders agree with it.
+ */
+int genecc_selftest(void)
+{
+	static const u8 golden[3][10] = {
+		{ 0x3f, 0x27, 0x56, 0xf5, 0x29, 0xd8, 0x61, 0xd9, 0x9d, 0x14 },
+		{ 0xac, 0x00, 0xf4, 0x5e, 0x75, 0x52, 0x52, 0xb5, 0xbc, 0x78 },
+		{ 0x18, 0x95, 0x11, 0x2a, 0xc1, 0xd4, 0xd0, 0xe1, 0xf8, 0xdf },
+	};
+	u8 buf[K], ecc[10], ecc_ref[10];
+	u32 seed = 1;
+	int i, v, fail = 0;
+
+	for (v = 0; v < 3; v++) {
+		for (i = 0; i < K; i++) {
+			if (v == 0) {
+				buf[i] = 0xff;
+			} else if (v == 1) {
+				buf[i] = i;
+			} else {
+				seed = seed * 1103515245u + 12345u;
+				buf[i] = seed >> 16;
+			}
+		}
+		gen_subpage_ecc(buf, ecc);
+		gen_subpage_ecc_ref(buf, ecc_ref);
+		if (memcmp(ecc, golden[v], 10) || memcmp(ecc_ref, golden[v], 10)) {
+			ERR("ECC mismatch on golden vector %d\n", v);
+			fail = 1;
+		}
+	}
+	return fail ? -1 : 0;
+}
+
+/*
+ * Decoder. The codeword is the 512 data bytes as symbols of x^519 down to
+ * x^8, then the 8 parity symbols as x^7 down to x^0; g(x) has the roots
+ * alpha^1..alpha^8. The remainder of a read back codeword mod g(x) is the
+ * parity of its data XOR the stored parity, so the vector encoder does the
+ * heavy lifting and a clean subpage costs no more than encoding it.
+ */
+
+static int popcount(bgfe x)
+{
+	int n = 0;
+
+	for (; x; x &= x - 1)
+		n++;
+	return n;
+}
+
+/*
+ * Correct subpage buf and its stored ecc in place, calc being the parity
+ * generated from buf as read. Syndromes, Berlekamp-Massey, Chien search
+ * and Forney. Returns the number of bits corrected, or -1 if there are
+ * more than MAX_CORR_ERR symbol errors.
+ */
+static int decode_subpage(u8 *buf, u8 *ecc, const u8 *calc)
+{
+	bgfe rem[2 * S], par[2 * S], syn[2 * S];
+	bgfe lambda[2 * S + 1], prev[2 * S + 1], tmp[2 * S + 1];
+	bgfe omega, dlambda, x, d, e, prev_d;
+	int pos[S], val[S];
+	int i, j, k, n, L, m, nerr, flips;
+
+	if (!memcmp(ecc, calc, 10))
+		return 0;
+
+	unpack_parity(calc, rem);
+	unpack_parity(ecc, par);
+	for (k = 0; k < 2 * S; k++)
+		rem[k] ^= par[k];
+
+	// S_i = rem(alpha^i), Horner from the top coefficient
+	for (i = 0; i < 2 * S; i++) {
+		syn[i] = 0;
+		for (k = 2 * S - 1; k >= 0; k--)
+			syn[i] = gf_mul(syn[i], alpha[i + 1]) ^ rem[k];
+	}
+
+	// Berlekamp-Massey: shortest LFSR lambda(x) generating the syndromes
+	memset(lambda, 0, sizeof(lambda));
+	memset(prev, 0, sizeof(prev));
+	lambda[0] = prev[0] = 1;
+	L = 0;
+	m = 1;
+	prev_d = 1;
+	for (n = 0; n < 2 * S; n++) {
+		d = syn[n];
+		for (i = 1; i <= L; i++)
+			d ^= gf_mul(lambda[i], syn[n - i]);
+		if (!d) {
+			m++;
+			continue;
+		}
+		memcpy(tmp, lambda, sizeof(tmp));
+		e = gf_div(d, prev_d);
+		for (i = 0; i + m <= 2 * S; i++)
+			lambda[i + m] ^= gf_mul(e, prev[i]);
+		if (2 * L <= n) {
+			L = n + 1 - L;
+			memcpy(prev, tmp, sizeof(prev));
+			prev_d = d;
+			m = 1;
+		} else {
+			m++;
+		}
+	}
+	if (L > S)
+		return -1;
+
+	/*
+	 * Chien search over the positions of the shortened code: position j
+	 * is in error if lambda(alpha^-j) = 0. Forney gives the error value
+	 * omega(X^-1) / lambda'(X^-1), omega = syn * lambda mod x^2S.
+	 */
+	nerr = 0;
+	for (j = 0; j < N; j++) {
+		x = alpha[(LENGTH - 1 - j) % (LENGTH - 1)];
+		d = 0;
+		for (i = L; i >= 0; i--)
+			d = gf_mul(d, x) ^ lambda[i];
+		if (d)
+			continue;
+		if (nerr == L)
+			return -1;
+
+		omega = 0;
+		for (k = L - 1; k >= 0; k--) {
+			e = 0;
+			for (i = 0; i <= k; i++)
+				e ^= gf_mul(lambda[i], syn[k - i]);
+			omega = gf_mul(omega, x) ^ e;
+		}
+		dlambda = 0;
+		for (i = L - (L % 2 == 0); i >= 1; i -= 2)
+			dlambda = gf_mul(gf_mul(dlambda, x), x) ^ lambda[i];
+		if (!dlambda)
+			return -1;
+		pos[nerr] = j;
+		val[nerr] = gf_div(omega, dlambda);
+		nerr++;
+	}
+	if (nerr != L)
+		return -1;
+
+	// data symbols are bytes, an error outside 8 bits is a miscorrection
+	for (i = 0; i < nerr; i++)
+		if (pos[i] >= 2 * S && val[i] > 0xff)
+			return -1;
+
+	flips = 0;
+	for (i = 0; i < nerr; i++) {
+		if (pos[i] >= 2 * S)
+			buf[(N - 1) - pos[i]] ^= val[i];
+		else
+			par[pos[i]] ^= val[i];
+		flips += popcount(val[i]);
+	}
+	pack_parity(par, ecc);
+	return flips;
+}
+
+/*
+ * Check npages raw pages (genecc_page_raw bytes each) in the given layout
+ * and correct them in place. flips[] gets the bits corrected per subpage,
+ * page by page, or -1 for an uncorrectable subpage. Returns the worst
+ * subpage's count, -1 if any is uncorrectable.
+ */
+int genecc_check(u8 *raw, int npages, int layout, int *flips)
+{
+	const u8 *sub[GENECC_BATCH_SUBPAGES];
+	u8 *data[GENECC_BATCH_SUBPAGES], *ecc[GENECC_BATCH_SUBPAGES];
+	u8 calc[GENECC_BATCH_SUBPAGES][10];
+	u8 *calc_p[GENECC_BATCH_SUBPAGES];
+	int per_page = genecc_page_data / GENECC_SUBPAGE_DATA;
+	int p, n, nsub, worst = 0;
+
+	for (n = 0; n < GENECC_BATCH_SUBPAGES; n++)
+		calc_p[n] = calc[n];
+
+	while (npages > 0) {
+		nsub = 0;
+		for (p = 0; p < npages && nsub + per_page <= GENECC_BATCH_SUBPAGES;
+				p++) {
+			for (n = 0; n < per_page; n++, nsub++) {
+				if (layout == GENECC_LAYOUT_LEGACY) {
+					data[nsub] = &raw[subsz_raw * n];
+					ecc[nsub] = data[nsub] + subsz_data + 6;
+				} else {
+					data[nsub] = &raw[subsz_data * n];
+					ecc[nsub] = &raw[genecc_page_data +
+						GENECC_SUBPAGE_OOB * n + 6];
+				}
+				sub[nsub] = data[nsub];
+			}
+			raw += genecc_page_raw;
+		}
+		gen_multi_ecc(sub, calc_p, nsub);
+		for (n = 0; n < nsub; n++) {
+			*flips = decode_subpage(data[n], ecc[n], calc[n]);
+			if (*flips < 0 || worst < 0)
+				worst = -1;
+			else if (*flips > worst)
+				worst = *flips;
+			flips++;
+		}
+		npages -= p;
+	}
+	return worst;
+}
+
+/*
+ * Set the NAND page geometry for the layouts: in-band size a multiple of
+ * 512, with at least 16 bytes of OOB per subpage. Extra OOB is left FF.
+ * Returns -1 if the layouts cannot be used with it.
+ */
+int genecc_set_geometry(int writesize, int oobsize)
+{
+	int nsub = writesize / subsz_data;
+
+	if (writesize <= 0 || writesize % subsz_data ||
+			nsub > GENECC_BATCH_SUBPAGES ||
+			oobsize < nsub * GENECC_SUBPAGE_OOB)
+		return -1;
+
+	genecc_page_data = writesize;
+	genecc_page_raw = writesize + oobsize;
+	genecc_batch_pages = GENECC_BATCH_SUBPAGES / nsub;
+	page_oob = oobsize;
+	return 0;
+}
+
+/*
+ * Lay out one page from src in raw and point sub/ecc at its subpages and
+ * where their ECC goes. Returns the number of subpages, or -1.
+ * Always inlined, so with constant data/oobsz the copies are fixed size and
+ * the subpage loops unrolled.
+ */
+static inline __attribute__((always_inline)) int layout_page(const u8 *src,
+		u8 *raw, int layout, int data, int oobsz, const u8 **sub, u8 **ecc)
 {
-	int n;
 	unsigned char *raw_subpage, *oob;
+	int nsub = data / GENECC_SUBPAGE_DATA;
+	int n;
 
 	switch (layout) {
 	case GENECC_LAYOUT_LEGACY:
-		for (n = 0; n < 4; n++) {
-			raw_subpage = &mtd_raw_buf[subsz_raw * n];
+		for (n = 0; n < nsub; n++) {
+			raw_subpage = &raw[subsz_raw * n];
 			oob = raw_subpage + subsz_data;
 
 			// copy data to correct locations in raw page
 			memcpy(raw_subpage, &src[subsz_data * n], subsz_data);
 
 			/*
-			 * RBL ignores ECC so we shouldn't HAVE to generate any - but let's.
-			 * legacy OOB format is 6 bytes spare, 10 bytes ECC
+			 * RBL ignores ECC so we shouldn't HAVE to generate any -
+			 * but let's. Legacy OOB format is 6 bytes spare,
+			 * 10 bytes ECC
 			 */
 			memset(oob, 0xff, 6);
-			gen_subpage_ecc(raw_subpage, oob + 6);
+			sub[n] = &src[subsz_data * n];
+			ecc[n] = oob + 6;
 		}
+		// OOB past the last subpage's 16 bytes is spare
+		if (oobsz > nsub * GENECC_SUBPAGE_OOB)
+			memset(&raw[subsz_raw * nsub], 0xff,
+					oobsz - nsub * GENECC_SUBPAGE_OOB);
 		break;
 	case GENECC_LAYOUT_DM365_RBL:
 		/*
-		 * This layout is all data where it should be, in the first 2KB of the
-		 * page, but ECC is laid out in the OOB in units of 6 FF, 10 ECC per
-		 * subpage, instead of all 40 bytes of ECC being at the end of OOB.
+		 * This layout is all data where it should be, in the first
+		 * part of the page, but ECC is laid out in the OOB in units
+		 * of 6 FF, 10 ECC per subpage, instead of all the ECC being at the
+		 * end of OOB.
 		 */
-		memcpy(mtd_raw_buf, src, pagesz_data);
-		
-		oob = mtd_raw_buf + pagesz_data;
-		memset(oob, 0xff, 16 * 4);
-	
-		for (n = 0; n < 4; n++) {
-			raw_subpage = &mtd_raw_buf[subsz_data * n];
-			gen_subpage_ecc(raw_subpage, oob + (n * 16) + 6);
+		memcpy(raw, src, data);
+
+		oob = raw + data;
+		memset(oob, 0xff, oobsz);
+
+		for (n = 0; n < nsub; n++) {
+			sub[n] = &src[subsz_data * n];
+			ecc[n] = oob + (n * GENECC_SUBPAGE_OOB) + 6;
 		}
 		break;
 	default:
 		ERR("BUG: bad layout value %d\n", layout);
+		return -1;
+	}
+	return nsub;
+}
+
+static inline __attribute__((always_inline)) void block_layout(const u8 *src,
+		u8 *raw, int npages, int layout, int data, int oobsz)
+{
+	const u8 *sub[GENECC_BATCH_SUBPAGES];
+	u8 *ecc[GENECC_BATCH_SUBPAGES];
+	int per_page = data / GENECC_SUBPAGE_DATA;
+	int p, n, nsub;
+
+	while (npages > 0) {
+		nsub = 0;
+		for (p = 0; p < npages && nsub + per_page <= GENECC_BATCH_SUBPAGES;
+				p++) {
+			n = layout_page(src, raw, layout, data, oobsz, &sub[nsub],
+					&ecc[nsub]);
+			if (n < 0)
+				return;
+			nsub += n;
+			src += data;
+			raw += data + oobsz;
+		}
+		gen_multi_ecc(sub, ecc, nsub);
+		npages -= p;
 	}
-	return mtd_raw_buf;
+}
+
+/*
+ * Lay out npages pages from src as raw data + OOB pages in raw (each
+ * genecc_page_raw bytes) and fill in the ECC. Subpages of several pages
+ * are handed to the parity backend together so vector lanes stay full.
+ * Common geometries get their own copy of the layout code.
+ */
+void genecc_block(const u8 *src, u8 *raw, int npages, int layout)
+{
+	STATS_VAR(t0);
+
+	STATS_BEGIN(t0);
+	if (genecc_page_data == 2048 && page_oob == 64)
+		block_layout(src, raw, npages, layout, 2048, 64);
+	else if (genecc_page_data == 512 && page_oob == 16)
+		block_layout(src, raw, npages, layout, 512, 16);
+	else if (genecc_page_data == 4096 && page_oob == 224)
+		block_layout(src, raw, npages, layout, 4096, 224);
+	else if (genecc_page_data == 4096 && page_oob == 128)
+		block_layout(src, raw, npages, layout, 4096, 128);
+	else
+		block_layout(src, raw, npages, layout, genecc_page_data, page_oob);
+	STATS_END(STAT_ECC, t0, (long long)npages * genecc_page_data, -1);
+}
+
+/* Single page version of genecc_block(), returns raw */
+unsigned char *do_genecc(const u8 *src, u8 *raw, int layout)
+{
+	genecc_block(src, raw, 1, layout);
+	return raw;
 }
@@ -2,13 +2,34 @@
 #define GENECC_H
 
 typedef unsigned char	u8;
+typedef unsigned short	u16;
 typedef unsigned int	u32;
 typedef signed int		s32;
 
 #define GENECC_LAYOUT_LEGACY		1
 #define GENECC_LAYOUT_DM365_RBL		2
 
+// each 512 byte subpage takes 16 bytes of OOB: 6 FF + 10 ECC
+#define GENECC_SUBPAGE_DATA			512
+#define GENECC_SUBPAGE_OOB			16
+
+// subpages per parity backend call in genecc_block(), also the page limit
+#define GENECC_BATCH_SUBPAGES		32
+
+// page geometry set by genecc_set_geometry(), 2048 + 64 by default
+extern int genecc_page_data;
+extern int genecc_page_raw;			// data + OOB
+extern int genecc_batch_pages;		// whole pages in GENECC_BATCH_SUBPAGES
+
 void genecc_init(void);
-unsigned char *do_genecc(const u8 *src, int layout);
+int genecc_set_geometry(int writesize, int oobsize);
+int genecc_selftest(void);
+void gen_subpage_ecc(const u8 *buf, u8 *ecc);
+void gen_subpage_ecc_ref(const u8 *buf, u8 *ecc);
+unsigned char *do_genecc(const u8 *src, u8 *raw, int layout);
+void genecc_block(const u8 *src, u8 *raw, int npages, int layout);
+int genecc_check(u8 *raw, int npages, int layout, int *flips);
+int genecc_set_backend(const char *name);
+const char *genecc_backend_name(void);
 
 #endif // GENECC_H
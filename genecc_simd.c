@@ -0,0 +1,178 @@
+/*
+ * Vector backends for the RS parity generator: many subpage LFSRs in
+ * parallel, one per byte lane, with split-nibble shuffle GF multiply.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define GENECC_X86
+#  include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define GENECC_NEON
+#  include <arm_neon.h>
+#  ifndef __aarch64__
+#    include <sys/auxv.h>
+#    include <asm/hwcap.h>
+#  endif
+#endif
+
+#include "debug.h"
+#include "genecc_simd.h"
+
+/*
+ * Products of a feedback symbol nibble with the generator coefficients.
+ * nib_lo[k][n][x]: low byte of (x << 4n) * gp[k], n = 0..2 (bits 0-3, 4-7,
+ * 8-9 of the feedback). nib_hi[h][n][x]: the 2 high bits of the same
+ * products for gp[4h + 0..3], packed 2 bits per coefficient.
+ */
+static u8 nib_lo[8][3][16] __attribute__((aligned(16)));
+static u8 nib_hi[2][3][16] __attribute__((aligned(16)));
+
+void genecc_simd_init(const u16 (*fbtab)[8])
+{
+	int k, n, x;
+	u16 prod;
+
+	memset(nib_hi, 0, sizeof(nib_hi));
+	for (k = 0; k < 8; k++) {
+		for (n = 0; n < 3; n++) {
+			for (x = 0; x < 16; x++) {
+				// only 2 bits in the top nibble
+				prod = (n < 2 || x < 4) ? fbtab[x << (4 * n)][k] : 0;
+				nib_lo[k][n][x] = prod & 0xff;
+				nib_hi[k >> 2][n][x] |= (prod >> 8) << (2 * (k & 3));
+			}
+		}
+	}
+}
+
+#ifdef GENECC_X86
+
+static int ssse3_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#define KFN			lanes_ssse3
+#define KTARGET		__attribute__((target("ssse3")))
+#define VEC			__m128i
+#define LANES		16
+#define VROW(s, j, i)	_mm_loadu_si128((const __m128i *)((s)[j] + (i)))
+#define VUNPLO(a, b)	_mm_unpacklo_epi8(a, b)
+#define VUNPHI(a, b)	_mm_unpackhi_epi8(a, b)
+#define VXOR(a, b)		_mm_xor_si128(a, b)
+#define VAND(a, b)		_mm_and_si128(a, b)
+#define VOR(a, b)		_mm_or_si128(a, b)
+#define VZERO			_mm_setzero_si128()
+#define VSET1(c)		_mm_set1_epi8(c)
+#define VSTORE(p, v)	_mm_store_si128((__m128i *)(p), v)
+#define VSHL2(a)		_mm_and_si128(_mm_slli_epi16(a, 2), _mm_set1_epi8(0xfc))
+#define VSHR4(a)		_mm_and_si128(_mm_srli_epi16(a, 4), _mm_set1_epi8(0x0f))
+#define VSHR6(a)		_mm_and_si128(_mm_srli_epi16(a, 6), _mm_set1_epi8(0x03))
+#define VSHUF(t, x)		_mm_shuffle_epi8(_mm_load_si128((const __m128i *)(t)), x)
+#include "genecc_simd_kernel.h"
+
+#define KFN			lanes_avx2
+#define KTARGET		__attribute__((target("avx2")))
+#define VEC			__m256i
+#define LANES		32
+#define VROW(s, j, i)	_mm256_inserti128_si256(_mm256_castsi128_si256( \
+			_mm_loadu_si128((const __m128i *)((s)[j] + (i)))), \
+			_mm_loadu_si128((const __m128i *)((s)[(j) + 16] + (i))), 1)
+#define VUNPLO(a, b)	_mm256_unpacklo_epi8(a, b)
+#define VUNPHI(a, b)	_mm256_unpackhi_epi8(a, b)
+#define VXOR(a, b)		_mm256_xor_si256(a, b)
+#define VAND(a, b)		_mm256_and_si256(a, b)
+#define VOR(a, b)		_mm256_or_si256(a, b)
+#define VZERO			_mm256_setzero_si256()
+#define VSET1(c)		_mm256_set1_epi8(c)
+#define VSTORE(p, v)	_mm256_store_si256((__m256i *)(p), v)
+#define VSHL2(a)		_mm256_and_si256(_mm256_slli_epi16(a, 2), _mm256_set1_epi8(0xfc))
+#define VSHR4(a)		_mm256_and_si256(_mm256_srli_epi16(a, 4), _mm256_set1_epi8(0x0f))
+#define VSHR6(a)		_mm256_and_si256(_mm256_srli_epi16(a, 6), _mm256_set1_epi8(0x03))
+#define VSHUF(t, x)		_mm256_shuffle_epi8(_mm256_broadcastsi128_si256( \
+			_mm_load_si128((const __m128i *)(t))), x)
+#include "genecc_simd_kernel.h"
+
+#endif // GENECC_X86
+
+#ifdef GENECC_NEON
+
+static int neon_supported(void)
+{
+#ifdef __aarch64__
+	return 1;
+#else
+	return !!(getauxval(AT_HWCAP) & HWCAP_NEON);
+#endif
+}
+
+#ifdef __aarch64__
+#  define NEON_ZIPLO(a, b)	vzip1q_u8(a, b)
+#  define NEON_ZIPHI(a, b)	vzip2q_u8(a, b)
+#  define NEON_TBL(t, x)	vqtbl1q_u8(vld1q_u8(t), x)
+#else
+#  define NEON_ZIPLO(a, b)	(vzipq_u8(a, b).val[0])
+#  define NEON_ZIPHI(a, b)	(vzipq_u8(a, b).val[1])
+static inline uint8x16_t neon_tbl(const u8 *t, uint8x16_t x)
+{
+	uint8x8x2_t tab = { { vld1_u8(t), vld1_u8(t + 8) } };
+
+	return vcombine_u8(vtbl2_u8(tab, vget_low_u8(x)),
+			vtbl2_u8(tab, vget_high_u8(x)));
+}
+#  define NEON_TBL(t, x)	neon_tbl(t, x)
+#endif
+
+#define KFN			lanes_neon
+#define KTARGET
+#define VEC			uint8x16_t
+#define LANES		16
+#define VROW(s, j, i)	vld1q_u8((s)[j] + (i))
+#define VUNPLO(a, b)	NEON_ZIPLO(a, b)
+#define VUNPHI(a, b)	NEON_ZIPHI(a, b)
+#define VXOR(a, b)		veorq_u8(a, b)
+#define VAND(a, b)		vandq_u8(a, b)
+#define VOR(a, b)		vorrq_u8(a, b)
+#define VZERO			vdupq_n_u8(0)
+#define VSET1(c)		vdupq_n_u8(c)
+#define VSTORE(p, v)	vst1q_u8(p, v)
+#define VSHL2(a)		vshlq_n_u8(a, 2)
+#define VSHR4(a)		vshrq_n_u8(a, 4)
+#define VSHR6(a)		vshrq_n_u8(a, 6)
+#define VSHUF(t, x)		NEON_TBL(t, x)
+#include "genecc_simd_kernel.h"
+
+#endif // GENECC_NEON
+
+/* widest first, genecc_init() picks the first supported one */
+const struct genecc_backend genecc_backends[] = {
+#ifdef GENECC_X86
+	{ "avx2",	32,	avx2_supported,		lanes_avx2 },
+	{ "ssse3",	16,	ssse3_supported,	lanes_ssse3 },
+#endif
+#ifdef GENECC_NEON
+	{ "neon",	16,	neon_supported,		lanes_neon },
+#endif
+	{},
+};
@@ -0,0 +1,24 @@
+#ifndef GENECC_SIMD_H
+#define GENECC_SIMD_H
+
+#include "genecc.h"
+
+/*
+ * Lane-parallel RS parity backends, internal to genecc.
+ * A backend runs one 512-byte subpage LFSR per vector lane and leaves the
+ * 8 parity symbols of lane l in par[l][0..7].
+ */
+#define GENECC_MAX_LANES	32
+
+struct genecc_backend {
+	const char	*name;
+	int			lanes;
+	int			(*supported)(void);
+	void		(*run)(const u8 *const *src, u16 (*par)[8]);
+};
+
+extern const struct genecc_backend genecc_backends[];
+
+void genecc_simd_init(const u16 (*fbtab)[8]);
+
+#endif // GENECC_SIMD_H
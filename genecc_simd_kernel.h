@@ -0,0 +1,113 @@
+/*
+ * Lane-parallel RS parity kernel body.
+ *
+ * Included once per vector backend from genecc_simd.c with these defined:
+ *   KFN, KTARGET	function name and target attribute
+ *   VEC, LANES		vector type and number of byte lanes
+ *   VROW(src, j, i)	bytes i..i+15 of subpage j (and j + 16 in the upper
+ *					128 bits of 256-bit vectors)
+ *   VUNPLO/VUNPHI	interleave low/high bytes of two vectors
+ *   VXOR, VAND, VOR, VZERO, VSET1(c), VSTORE(p, v)
+ *   VSHL2, VSHR4, VSHR6	per-byte shifts
+ *   VSHUF(t, idx)	16-entry byte table lookup, t a 16-byte table
+ *
+ * Each byte lane runs the same LFSR as gen_subpage_ecc(). Remainder symbols
+ * are split into a low byte vector per symbol (rl0..rl7) and the 2 high
+ * bits of r0..r3 / r4..r7 packed into ha / hb. Feedback is multiplied by
+ * the generator coefficients with three nibble table lookups (bits 0-3,
+ * 4-7, 8-9) per output vector, see genecc_simd_init().
+ */
+
+#define PROD_LO(k)	VXOR(VXOR(VSHUF(nib_lo[k][0], n0), VSHUF(nib_lo[k][1], n1)), \
+						VSHUF(nib_lo[k][2], n2))
+#define PROD_HI(h)	VXOR(VXOR(VSHUF(nib_hi[h][0], n0), VSHUF(nib_hi[h][1], n1)), \
+						VSHUF(nib_hi[h][2], n2))
+
+KTARGET static void KFN(const u8 *const *src, u16 (*par)[8])
+{
+	VEC rl0, rl1, rl2, rl3, rl4, rl5, rl6, rl7, ha, hb;
+	VEC d[16], t[16];
+	VEC f, n0, n1, n2, m4;
+	u8 lo[8][LANES] __attribute__((aligned(32)));
+	u8 hi[2][LANES] __attribute__((aligned(32)));
+	int i, j, r, l, k;
+
+	rl0 = rl1 = rl2 = rl3 = rl4 = rl5 = rl6 = rl7 = ha = hb = VZERO;
+	m4 = VSET1(0x0f);
+
+	for (i = 0; i < 512; i += 16) {
+		/*
+		 * Transpose 16 bytes of 16 subpages so d[j] holds byte i + j of
+		 * every lane: four rounds of perfect shuffle.
+		 */
+		for (j = 0; j < 16; j++)
+			d[j] = VROW(src, j, i);
+		for (r = 0; r < 4; r++) {
+			for (j = 0; j < 8; j++) {
+				t[2 * j] = VUNPLO(d[j], d[j + 8]);
+				t[2 * j + 1] = VUNPHI(d[j], d[j + 8]);
+			}
+			for (j = 0; j < 16; j++)
+				d[j] = t[j];
+		}
+
+		for (j = 0; j < 16; j++) {
+			VEC pa, pb;
+
+			f = VXOR(d[j], rl7);
+			n0 = VAND(f, m4);
+			n1 = VSHR4(f);
+			n2 = VSHR6(hb);
+
+			rl7 = VXOR(rl6, PROD_LO(7));
+			rl6 = VXOR(rl5, PROD_LO(6));
+			rl5 = VXOR(rl4, PROD_LO(5));
+			rl4 = VXOR(rl3, PROD_LO(4));
+			rl3 = VXOR(rl2, PROD_LO(3));
+			rl2 = VXOR(rl1, PROD_LO(2));
+			rl1 = VXOR(rl0, PROD_LO(1));
+			rl0 = PROD_LO(0);
+
+			pa = PROD_HI(0);
+			pb = PROD_HI(1);
+			hb = VXOR(VOR(VSHL2(hb), VSHR6(ha)), pb);
+			ha = VXOR(VSHL2(ha), pa);
+		}
+	}
+
+	VSTORE(lo[0], rl0);
+	VSTORE(lo[1], rl1);
+	VSTORE(lo[2], rl2);
+	VSTORE(lo[3], rl3);
+	VSTORE(lo[4], rl4);
+	VSTORE(lo[5], rl5);
+	VSTORE(lo[6], rl6);
+	VSTORE(lo[7], rl7);
+	VSTORE(hi[0], ha);
+	VSTORE(hi[1], hb);
+
+	for (l = 0; l < LANES; l++)
+		for (k = 0; k < 8; k++)
+			par[l][k] = lo[k][l] |
+				(((hi[k >> 2][l] >> (2 * (k & 3))) & 3) << 8);
+}
+
+#undef PROD_LO
+#undef PROD_HI
+#undef KFN
+#undef KTARGET
+#undef VEC
+#undef LANES
+#undef VROW
+#undef VUNPLO
+#undef VUNPHI
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VZERO
+#undef VSET1
+#undef VSTORE
+#undef VSHL2
+#undef VSHR4
+#undef VSHR6
+#undef VSHUF
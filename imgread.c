@@ -0,0 +1,492 @@
+/*
+ * Image reader: a thread reads erase blocks of the input image into a ring
+ * of buffers ahead of the writer, so input latency overlaps erase and
+ * program time. Regular files are mmapped instead and full blocks handed
+ * out straight from the mapping.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "imgread.h"
+#include "monotime.h"
+#include "sparse.h"
+#include "stats.h"
+#include "trace.h"
+
+static int				image_fd;
+static int				block_size;
+static int				start_pad;		// FF bytes before data in first block
+static long long		length;			// image bytes to read, -1 up to EOF
+static unsigned char	*slots[IMGREAD_SLOTS];
+static pthread_t		reader;
+static int				reader_running;
+static ssize_t			(*read_fn)(int fd, void *buf, size_t count) = read;
+
+/* sparse image, reader thread only */
+static int				sparse_page;	// page size, 0 if not sparse
+static unsigned char	*skip_maps[IMGREAD_SLOTS];	// per page, 1: don't care
+static int				chunk_type;
+static unsigned int		chunk_left;		// pages left in current chunk
+
+/* mmap mode, writer thread only */
+static unsigned char	*map;			// whole image, NULL if not mapped
+static int				map_blk;		// next logical block to hand out
+static long long		map_dropped;	// image bytes released from our RSS
+
+/* ring state, protected by lock */
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	data_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	space_cond = PTHREAD_COND_INITIALIZER;
+static int				head;			// next slot the reader fills
+static int				tail;			// slot the writer holds / gets next
+static int				full;			// filled slots not yet handed out
+static int				held;			// writer holds slots[tail]
+static int				reader_done;	// no more blocks will be filled
+static int				read_error;
+static int				stopping;
+static long long		eof_length;		// length < 0: image bytes, once EOF seen
+static unsigned long long wait_ns;		// writer waiting for the reader
+static unsigned long long full_ns;		// reader waiting for the writer
+
+/*
+ * Where image data goes in logical image block blk: FF before start_pad in
+ * the first block, FF after the end of the image in the last. *done is the
+ * number of image bytes in earlier blocks. Up to EOF, every block is full
+ * until read_block() finds otherwise.
+ */
+static void block_extent(int blk, int *buf_start, int *buf_end,
+		long long *done)
+{
+	if (blk == 0) {
+		*buf_start = start_pad;
+		*done = 0;
+	} else {
+		*buf_start = 0;
+		*done = (long long)blk * block_size - start_pad;
+	}
+	if (length >= 0 && *done + block_size - *buf_start > length)
+		*buf_end = length - *done + *buf_start;
+	else
+		*buf_end = block_size;
+}
+
+/* Read exactly len bytes with read_fn. Returns 0 or -1. */
+static int read_exact(unsigned char *buf, int len)
+{
+	int ret, got = 0;
+
+	while (got < len) {
+		ret = read_fn(image_fd, &buf[got], len - got);
+		if (ret <= 0) {
+			if (ret == 0)
+				fprintf(stderr, "Unexpected EOF reading input file\n");
+			else if (read_fn == read)
+				perror("Reading image file");
+			return -1;
+		}
+		got += ret;
+	}
+	return 0;
+}
+
+/*
+ * Sparse image: fill pages [buf_start, buf_end) of buf from the chunks.
+ * Don't care pages are set to FF without reading anything and flagged in
+ * skip, as are the pad pages outside the range. Returns the number of
+ * image bytes, or -1.
+ */
+static int read_sparse(unsigned char *buf, unsigned char *skip, int buf_start,
+		int buf_end)
+{
+	unsigned char hdr[SPARSE_CHUNK_SIZE];
+	int pos;
+
+	memset(skip, 1, block_size / sparse_page);
+	for (pos = buf_start; pos < buf_end; pos += sparse_page) {
+		if (!chunk_left) {
+			if (read_exact(hdr, sizeof(hdr)) < 0)
+				return -1;
+			chunk_type = sparse_get32(hdr);
+			chunk_left = sparse_get32(hdr + 4);
+			if ((chunk_type != SPARSE_DATA &&
+						chunk_type != SPARSE_DONT_CARE) || !chunk_left) {
+				fprintf(stderr, "Bad chunk in sparse image\n");
+				return -1;
+			}
+		}
+		chunk_left--;
+
+		if (chunk_type == SPARSE_DONT_CARE) {
+			memset(&buf[pos], 0xff, sparse_page);
+			continue;
+		}
+		// a partial last page is stored whole, FF padded
+		if (read_exact(&buf[pos], sparse_page) < 0)
+			return -1;
+		skip[pos / sparse_page] = 0;
+	}
+	return buf_end - buf_start;
+}
+
+/*
+ * Fill buf with logical image block blk. Returns the number of image bytes
+ * read, short only at EOF of an image of unknown length, or -1. *done is
+ * set as by block_extent().
+ */
+static int read_block(unsigned char *buf, unsigned char *skip, int blk,
+		long long *done)
+{
+	int buf_start;	// index of first image data
+	int buf_end;	// index of last image data + 1
+	int want_sz, read_sz;
+	int ret;
+
+	block_extent(blk, &buf_start, &buf_end, done);
+	memset(buf, 0xFF, buf_start);
+	memset(&buf[buf_end], 0xff, block_size - buf_end);
+
+	if (sparse_page)
+		return read_sparse(buf, skip, buf_start, buf_end);
+
+	want_sz = buf_end - buf_start;
+	read_sz = 0;
+	DBG("want %d bytes\n", want_sz);
+	while (read_sz < want_sz) {
+		ret = read_fn(image_fd, &buf[buf_start + read_sz], want_sz - read_sz);
+		if (ret == 0 && length < 0) {
+			// end of stream: pad as for the end of an image
+			memset(&buf[buf_start + read_sz], 0xff,
+					block_size - buf_start - read_sz);
+			break;
+		} else if (ret == 0) {
+			fprintf(stderr, "Unexpected EOF reading input file\n");
+			return -1;
+		} else if (ret < 0) {
+			// a read_fn other than read() reports its own errors
+			if (read_fn == read)
+				perror("Reading image file");
+			return -1;
+		}
+		DBG("read 0x%x (%d) bytes\n", ret, ret);
+		read_sz += ret;
+	}
+	return read_sz;
+}
+
+static void *reader_thread(void *arg)
+{
+	unsigned long long t0;
+	long long done;
+	int blk, ret, want;
+	STATS_VAR(ts);
+
+	TRACE_THREAD("image reader");
+	for (blk = 0; length < 0 ||
+			(long long)blk * block_size - start_pad < length; blk++) {
+		pthread_mutex_lock(&lock);
+		t0 = monotime_ns();
+		while (!stopping && full + held == IMGREAD_SLOTS)
+			pthread_cond_wait(&space_cond, &lock);
+		full_ns += monotime_ns() - t0;
+		if (stopping) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		pthread_mutex_unlock(&lock);
+
+		// only the reader touches slots[head] until it is counted full
+		STATS_BEGIN(ts);
+		ret = read_block(slots[head], skip_maps[head], blk, &done);
+		STATS_END(STAT_INPUT, ts, ret > 0 ? ret : 0, -1);
+		want = block_size - (blk ? 0 : start_pad);
+
+		pthread_mutex_lock(&lock);
+		if (ret < 0) {
+			read_error = 1;
+			pthread_cond_signal(&data_cond);
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		if (ret > 0) {
+			head = (head + 1) % IMGREAD_SLOTS;
+			full++;
+		}
+		// known before the writer can see the last block
+		if (length < 0 && ret < want)
+			eof_length = done + ret;
+		pthread_cond_signal(&data_cond);
+		pthread_mutex_unlock(&lock);
+		if (eof_length >= 0)
+			break;
+	}
+
+	pthread_mutex_lock(&lock);
+	reader_done = 1;
+	pthread_cond_signal(&data_cond);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * Map the image if it is a regular file. MADV_SEQUENTIAL has the kernel
+ * read ahead aggressively, standing in for the reader thread.
+ */
+static int map_image(void)
+{
+	struct stat st;
+	void *p;
+
+	// too big for the address space (32-bit): use the reader thread
+	if (length < 0 || read_fn != read || sparse_page ||
+			fstat(image_fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+			st.st_size < length || (size_t)length != length)
+		return -1;
+
+	p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, image_fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	madvise(p, length, MADV_SEQUENTIAL);
+
+	map = p;
+	map_blk = 0;
+	map_dropped = 0;
+	return 0;
+}
+
+/*
+ * Get image data with fn instead of read(2), e.g. a decompressor. It must
+ * return count bytes unless at the end of the image. Call before
+ * imgread_start(); the image is not mapped then.
+ */
+void imgread_set_read(ssize_t (*fn)(int fd, void *buf, size_t count))
+{
+	read_fn = fn;
+}
+
+/*
+ * The image on fd is in sparse format with pages of page_size bytes: read
+ * its header. Call before imgread_start(). Returns the image length, or -1.
+ */
+long long imgread_set_sparse(int fd, int page_size)
+{
+	unsigned char hdr[SPARSE_HDR_SIZE];
+
+	image_fd = fd;
+	if (read_exact(hdr, sizeof(hdr)) < 0)
+		return -1;
+	if (memcmp(hdr, SPARSE_MAGIC, 8) ||
+			sparse_get32(hdr + 8) != SPARSE_VERSION) {
+		fprintf(stderr, "Not a sparse image\n");
+		return -1;
+	}
+	if (sparse_get32(hdr + 12) != page_size) {
+		fprintf(stderr, "Sparse image has %u byte pages, need %d\n",
+				sparse_get32(hdr + 12), page_size);
+		return -1;
+	}
+	sparse_page = page_size;
+	chunk_left = 0;
+	return sparse_get32(hdr + 16) |
+		((long long)sparse_get32(hdr + 20) << 32);
+}
+
+/*
+ * Start reading length bytes of image from fd, in blocks of blocksize, the
+ * first block starting first_off bytes into the erase block. With length
+ * -1, read up to EOF; fd can be a pipe or socket.
+ * If use_mmap is set and fd is a regular file, map it rather than read.
+ */
+int imgread_start(int fd, int blocksize, int first_off, long long len,
+		int use_mmap)
+{
+	int i;
+
+	image_fd = fd;
+	block_size = blocksize;
+	start_pad = first_off;
+	length = len;
+	head = tail = full = held = 0;
+	reader_done = read_error = stopping = 0;
+	eof_length = -1;
+
+	if (use_mmap && map_image() == 0) {
+		DBG("image mapped\n");
+		// a single scratch slot for padded partial blocks
+		slots[0] = malloc(block_size);
+		return slots[0] ? 0 : -1;
+	}
+
+	for (i = 0; i < IMGREAD_SLOTS; i++) {
+		// page aligned so reads can go straight to the page cache
+		if (posix_memalign((void **)&slots[i], 4096, block_size) != 0) {
+			ERR("slot malloc failed\n");
+			return -1;
+		}
+		if (sparse_page) {
+			skip_maps[i] = malloc(block_size / sparse_page);
+			if (!skip_maps[i]) {
+				ERR("skip map malloc failed\n");
+				return -1;
+			}
+		}
+	}
+
+	if (pthread_create(&reader, NULL, reader_thread, NULL) != 0) {
+		ERR("pthread_create failed\n");
+		return -1;
+	}
+	reader_running = 1;
+	return 0;
+}
+
+/*
+ * mmap mode imgread_next(). Full blocks point into the mapping, only the
+ * first and last blocks are padded with FF through the scratch slot.
+ */
+static unsigned char *map_next(void)
+{
+	int buf_start, buf_end;
+	long long done, drop;
+	long pagesz = sysconf(_SC_PAGESIZE);
+
+	if ((long long)map_blk * block_size - start_pad >= length)
+		return NULL;
+	block_extent(map_blk, &buf_start, &buf_end, &done);
+	map_blk++;
+
+	/*
+	 * The writer is finished with everything before this block, drop
+	 * those pages from our RSS. They are not touched again.
+	 */
+	drop = done & ~(pagesz - 1);
+	if (drop > map_dropped) {
+		madvise(map + map_dropped, drop - map_dropped, MADV_DONTNEED);
+		map_dropped = drop;
+	}
+
+	if (buf_start == 0 && buf_end == block_size)
+		return map + done;
+
+	memset(slots[0], 0xFF, buf_start);
+	memcpy(&slots[0][buf_start], map + done, buf_end - buf_start);
+	memset(&slots[0][buf_end], 0xff, block_size - buf_end);
+	return slots[0];
+}
+
+/*
+ * Release the block returned last time and return the next one, waiting
+ * for the reader if needed. Returns NULL on read error or end of image.
+ */
+unsigned char *imgread_next(void)
+{
+	unsigned long long t0;
+	unsigned char *buf = NULL;
+
+	if (map)
+		return map_next();
+
+	pthread_mutex_lock(&lock);
+	if (held) {
+		held = 0;
+		tail = (tail + 1) % IMGREAD_SLOTS;
+		pthread_cond_signal(&space_cond);
+	}
+
+	t0 = monotime_ns();
+	while (!full && !read_error && !reader_done)
+		pthread_cond_wait(&data_cond, &lock);
+	wait_ns += monotime_ns() - t0;
+
+	if (full) {
+		full--;
+		held = 1;
+		buf = slots[tail];
+	}
+	pthread_mutex_unlock(&lock);
+	return buf;
+}
+
+void imgread_stop(void)
+{
+	int i;
+
+	if (reader_running) {
+		pthread_mutex_lock(&lock);
+		stopping = 1;
+		pthread_cond_signal(&space_cond);
+		pthread_mutex_unlock(&lock);
+		pthread_join(reader, NULL);
+		reader_running = 0;
+	}
+	if (map) {
+		munmap(map, length);
+		map = NULL;
+	}
+	for (i = 0; i < IMGREAD_SLOTS; i++) {
+		free(slots[i]);
+		slots[i] = NULL;
+		free(skip_maps[i]);
+		skip_maps[i] = NULL;
+	}
+}
+
+/*
+ * Sparse image: per page flags for the block last returned by
+ * imgread_next(), 1 for don't care pages that should not be programmed.
+ * NULL if the image is not sparse.
+ */
+const unsigned char *imgread_skip_map(void)
+{
+	return sparse_page && held ? skip_maps[tail] : NULL;
+}
+
+/*
+ * Image length as passed to imgread_start(), or if that was -1, the length
+ * read once EOF has been reached. -1 until then. It is known by the time
+ * imgread_next() returns the last block.
+ */
+long long imgread_length(void)
+{
+	long long ret;
+
+	if (length >= 0)
+		return length;
+	pthread_mutex_lock(&lock);
+	ret = eof_length;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/* Seconds the writer has spent waiting for input */
+double imgread_wait_time(void)
+{
+	return wait_ns / 1e9;
+}
+
+/* Seconds the reader has spent waiting for the writer to free a slot */
+double imgread_full_time(void)
+{
+	double t;
+
+	pthread_mutex_lock(&lock);
+	t = full_ns / 1e9;
+	pthread_mutex_unlock(&lock);
+	return t;
+}
@@ -0,0 +1,20 @@
+#ifndef IMGREAD_H
+#define IMGREAD_H
+
+#include <sys/types.h>
+
+// erase blocks of image data buffered ahead of the writer
+#define IMGREAD_SLOTS		4
+
+void imgread_set_read(ssize_t (*fn)(int fd, void *buf, size_t count));
+long long imgread_set_sparse(int fd, int page_size);
+int imgread_start(int fd, int blocksize, int first_off, long long length,
+		int use_mmap);
+unsigned char *imgread_next(void);
+void imgread_stop(void);
+long long imgread_length(void);
+const unsigned char *imgread_skip_map(void);
+double imgread_wait_time(void);
+double imgread_full_time(void);
+
+#endif // IMGREAD_H
@@ -0,0 +1,183 @@
+/*
+ * Image writer: the output side of a device dump. A thread writes filled
+ * buffers out from a ring while the next blocks are read from flash, so
+ * output latency (a slow disk, a pipe) overlaps device reads.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "imgwrite.h"
+#include "monotime.h"
+#include "trace.h"
+
+static int				image_fd;
+static unsigned char	*slots[IMGWRITE_SLOTS];
+static int				slot_len[IMGWRITE_SLOTS];
+static pthread_t		writer;
+static int				writer_running;
+
+/* ring state, protected by lock */
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	data_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	space_cond = PTHREAD_COND_INITIALIZER;
+static int				head;			// next slot the reader fills
+static int				tail;			// next slot the writer writes out
+static int				full;			// filled slots not yet written
+static int				write_error;
+static int				stopping;		// no more slots will be filled
+static unsigned long long wait_ns;		// reader waiting for a free slot
+
+/* Write all of buf. Returns 0 or -1. */
+static int write_all(const unsigned char *buf, int len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(image_fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			perror("Writing image file");
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	int ret;
+
+	TRACE_THREAD("image writer");
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (!full && !stopping)
+			pthread_cond_wait(&data_cond, &lock);
+		if (!full) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		pthread_mutex_unlock(&lock);
+
+		// only the writer touches slots[tail] until it is counted free
+		ret = write_all(slots[tail], slot_len[tail]);
+
+		pthread_mutex_lock(&lock);
+		if (ret < 0)
+			write_error = 1;
+		tail = (tail + 1) % IMGWRITE_SLOTS;
+		full--;
+		pthread_cond_signal(&space_cond);
+		pthread_mutex_unlock(&lock);
+		if (ret < 0)
+			break;
+	}
+	return NULL;
+}
+
+/* Start writing to fd, in buffers of up to bufsize bytes */
+int imgwrite_start(int fd, int bufsize)
+{
+	int i;
+
+	image_fd = fd;
+	head = tail = full = 0;
+	write_error = stopping = 0;
+
+	for (i = 0; i < IMGWRITE_SLOTS; i++) {
+		if (posix_memalign((void **)&slots[i], 4096, bufsize) != 0) {
+			ERR("slot malloc failed\n");
+			return -1;
+		}
+	}
+
+	if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+		ERR("pthread_create failed\n");
+		return -1;
+	}
+	writer_running = 1;
+	return 0;
+}
+
+/*
+ * The buffer to fill next, waiting for the writer to free one if needed.
+ * The same buffer is returned until it is passed on by imgwrite_put().
+ * NULL if the writer has failed.
+ */
+unsigned char *imgwrite_buf(void)
+{
+	unsigned long long t0;
+	unsigned char *buf = NULL;
+
+	pthread_mutex_lock(&lock);
+	t0 = monotime_ns();
+	while (full == IMGWRITE_SLOTS && !write_error)
+		pthread_cond_wait(&space_cond, &lock);
+	wait_ns += monotime_ns() - t0;
+
+	if (!write_error)
+		buf = slots[head];
+	pthread_mutex_unlock(&lock);
+	return buf;
+}
+
+/* Queue the first len bytes of the imgwrite_buf() buffer. Returns 0 or -1. */
+int imgwrite_put(int len)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&lock);
+	if (write_error) {
+		ret = -1;
+	} else {
+		slot_len[head] = len;
+		head = (head + 1) % IMGWRITE_SLOTS;
+		full++;
+		pthread_cond_signal(&data_cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/* Write out what is queued and stop. Returns 0, or -1 if a write failed. */
+int imgwrite_stop(void)
+{
+	int i;
+
+	if (writer_running) {
+		pthread_mutex_lock(&lock);
+		stopping = 1;
+		pthread_cond_signal(&data_cond);
+		pthread_mutex_unlock(&lock);
+		pthread_join(writer, NULL);
+		writer_running = 0;
+	}
+	for (i = 0; i < IMGWRITE_SLOTS; i++) {
+		free(slots[i]);
+		slots[i] = NULL;
+	}
+	return write_error ? -1 : 0;
+}
+
+/* Seconds the reader has spent waiting for the output to catch up */
+double imgwrite_wait_time(void)
+{
+	return wait_ns / 1e9;
+}
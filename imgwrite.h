@@ -0,0 +1,12 @@
+#ifndef IMGWRITE_H
+#define IMGWRITE_H
+
+#define IMGWRITE_SLOTS	4
+
+int imgwrite_start(int fd, int bufsize);
+unsigned char *imgwrite_buf(void);
+int imgwrite_put(int len);
+int imgwrite_stop(void);
+double imgwrite_wait_time(void);
+
+#endif // IMGWRITE_H
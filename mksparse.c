@@ -0,0 +1,163 @@
+/*
+ * mksparse - convert a flat image to the flashtool sparse format, with
+ * runs of all-FF pages as don't care chunks.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparse.h"
+
+// data pages buffered per chunk before it is written out
+#define MAX_RUN		256
+
+static unsigned char *run_buf;
+static int			run_type;
+static unsigned int	run_pages;
+static int			page_size = 2048;
+static FILE			*out;
+
+void usage(void)
+{
+	fprintf(stderr, "\nmksparse - make a flashtool --sparse image\n\n"
+"Usage:\n"
+"  mksparse [OPTIONS] image-file sparse-file\n\n"
+"  image-file       Flat image, - for stdin\n"
+"OPTIONS:\n"
+"  -p, --page n     Page size in bytes (default 2048)\n"
+"  -o, --oob n      Image has n bytes of OOB after each page (--raw-input)\n"
+"\n"
+	);
+}
+
+static void put(const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, out) != len) {
+		perror("Writing sparse file");
+		exit(1);
+	}
+}
+
+static void flush_run(void)
+{
+	unsigned char hdr[SPARSE_CHUNK_SIZE];
+
+	if (!run_pages)
+		return;
+	sparse_put32(hdr, run_type);
+	sparse_put32(hdr + 4, run_pages);
+	put(hdr, sizeof(hdr));
+	if (run_type == SPARSE_DATA)
+		put(run_buf, (size_t)run_pages * page_size);
+	run_pages = 0;
+}
+
+static int all_ff(const unsigned char *buf, int len)
+{
+	while (len--)
+		if (*buf++ != 0xff)
+			return 0;
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{"page",	required_argument,	0, 'p'},
+		{"oob",		required_argument,	0, 'o'},
+		{},
+	};
+	unsigned char hdr[SPARSE_HDR_SIZE], *page;
+	unsigned long long length = 0;
+	int oob_size = 0, type, c;
+	size_t got;
+	FILE *in;
+
+	while ((c = getopt_long(argc, argv, "p:o:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			page_size = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			oob_size = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (argc - optind != 2 || page_size <= 0 || oob_size < 0) {
+		usage();
+		return 1;
+	}
+	page_size += oob_size;
+
+	in = strcmp(argv[optind], "-") ? fopen(argv[optind], "rb") : stdin;
+	if (!in) {
+		perror(argv[optind]);
+		return 1;
+	}
+	// seekable, the header is filled in at the end
+	out = fopen(argv[optind + 1], "wb");
+	if (!out) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	run_buf = malloc((size_t)MAX_RUN * page_size);
+	page = malloc(page_size);
+	if (!run_buf || !page) {
+		fprintf(stderr, "malloc failed\n");
+		return 1;
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	put(hdr, sizeof(hdr));
+
+	while ((got = fread(page, 1, page_size, in)) > 0) {
+		length += got;
+		memset(page + got, 0xff, page_size - got);
+
+		type = all_ff(page, page_size) ? SPARSE_DONT_CARE : SPARSE_DATA;
+		if (type != run_type || (type == SPARSE_DATA && run_pages == MAX_RUN))
+			flush_run();
+		run_type = type;
+		if (type == SPARSE_DATA)
+			memcpy(run_buf + (size_t)run_pages * page_size, page, page_size);
+		run_pages++;
+	}
+	if (ferror(in)) {
+		perror("Reading image");
+		return 1;
+	}
+	flush_run();
+
+	memcpy(hdr, SPARSE_MAGIC, 8);
+	sparse_put32(hdr + 8, SPARSE_VERSION);
+	sparse_put32(hdr + 12, page_size);
+	sparse_put32(hdr + 16, length);
+	sparse_put32(hdr + 20, length >> 32);
+	if (fseek(out, 0, SEEK_SET) != 0) {
+		perror("Seeking sparse file");
+		return 1;
+	}
+	put(hdr, sizeof(hdr));
+	if (fclose(out) != 0) {
+		perror("Writing sparse file");
+		return 1;
+	}
+	return 0;
+}
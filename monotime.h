@@ -0,0 +1,20 @@
+#ifndef MONOTIME_H
+#define MONOTIME_H
+
+#include <time.h>
+
+/*
+ * Monotonic clock in ns, shared by stats_now() and the wait and I/O time
+ * totals of imgread, imgwrite and decomp. Totals are kept as one 64-bit
+ * count, as summing timespec fields overflows a 32-bit tv_nsec after
+ * about 2 s; convert to seconds (/ 1e9) only to report.
+ */
+static inline unsigned long long monotime_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+#endif // MONOTIME_H
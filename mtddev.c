@@ -0,0 +1,525 @@
+/*
+ * MTD character device backend: erase, write and read through /dev/mtdX
+ * and its ioctls.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ * Written by Jon Povey <jon.povey@racelogic.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "flashdev.h"
+#include "stats.h"
+
+#ifndef MTD_MODE_RAW
+#define MTD_MODE_RAW	MTD_FILE_MODE_RAW	// renamed in newer mtd-abi.h
+#endif
+
+static int			mtd_fd = -1;
+static struct mtd_info_user mi;
+static int			use_memwrite = 1;	// cleared if kernel lacks MEMWRITE
+static int			use_memread = 1;	// cleared if kernel lacks MEMREAD
+static unsigned char *run_data;			// raw runs: de-interleaved data
+static unsigned char *run_oob;			// and OOB of up to run_pages pages
+static int			run_pages;
+static long long	dev_size;
+
+static long long mtd_size(void)
+{
+	return dev_size;
+}
+
+static int mtd_erase(long long offset)
+{
+	struct erase_info_user ei;
+
+	DBG("erase block at 0x%llx\n", offset);
+
+#ifdef MEMERASE64
+	{
+		struct erase_info_user64 ei64;
+
+		ei64.start = offset;
+		ei64.length = mi.erasesize;
+		if (ioctl(mtd_fd, MEMERASE64, &ei64) == 0)
+			return 0;
+		if (errno != ENOTTY || offset > 0xffffffffLL)
+			return -errno;
+	}
+#endif
+	ei.start = offset;
+	ei.length = mi.erasesize;
+
+	if (ioctl(mtd_fd, MEMERASE, &ei) != 0)
+		return -errno;
+	return 0;
+}
+
+static int mtd_is_bad(long long offset)
+{
+	loff_t ll_off = offset;	// have to pass a long long to ioctl
+	int ret;
+
+	ret = ioctl(mtd_fd, MEMGETBADBLOCK, &ll_off);
+	return ret < 0 ? -errno : ret;
+}
+
+static int mtd_mark_bad(long long offset)
+{
+	loff_t ll_off = offset;
+
+	/*
+	 * This ioctl may only set the BBT (not sure).
+	 * We should possibly try to write the manufacturer bad block markers
+	 * in the block itself, for the UBL.
+	 */
+	if (ioctl(mtd_fd, MEMSETBADBLOCK, &ll_off) != 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Write in-band pages with one write(). The MTD char device programs them
+ * page by page. If it fails, the file position has moved past completed
+ * chunks only; mtdchar does not report progress within a failed chunk.
+ */
+static int mtd_write(long long off, const unsigned char *buf, int len, int *done)
+{
+	off_t pos;
+	ssize_t ret;
+	STATS_VAR(t0);
+
+	*done = 0;
+	if (lseek(mtd_fd, off, SEEK_SET) != off) {
+		perror("Write seek");
+		return -errno;
+	}
+
+	while (*done < len) {
+		STATS_BEGIN(t0);
+		ret = write(mtd_fd, buf + *done, len - *done);
+		STATS_END(STAT_WRITE, t0, ret > 0 ? ret : 0, off + *done);
+		if (ret <= 0) {
+			perror("Write pages");
+			ret = ret < 0 ? -errno : -EIO;
+			pos = lseek(mtd_fd, 0, SEEK_CUR);
+			if (pos > off + *done)
+				*done = pos - off;
+			return ret;
+		}
+		*done += ret;
+	}
+	return 0;
+}
+
+static int mtd_read(long long off, unsigned char *buf, int len)
+{
+	ssize_t ret;
+
+	ret = pread(mtd_fd, buf, len, off);
+	if (ret != len) {
+		if (ret < 0)
+			perror("Read pages");
+		return ret < 0 ? -errno : -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Program in-band data and OOB of a raw page with one MEMWRITE ioctl,
+ * instead of seek + write + MEMWRITEOOB (a second program operation).
+ * Returns 1 if the kernel does not support it, else 0 or -errno.
+ */
+static int write_raw_memwrite(long long pageoff, const unsigned char *raw)
+{
+#ifdef MEMWRITE
+	struct mtd_write_req req;
+	int ret;
+	STATS_VAR(t0);
+
+	memset(&req, 0, sizeof(req));
+	req.start = pageoff;
+	req.len = mi.writesize;
+	req.ooblen = mi.oobsize;
+	req.usr_data = (unsigned long)raw;
+	req.usr_oob = (unsigned long)(raw + mi.writesize);
+	req.mode = MTD_OPS_RAW;
+
+	STATS_BEGIN(t0);
+	ret = ioctl(mtd_fd, MEMWRITE, &req);
+	STATS_END(STAT_MEMWRITE, t0, mi.writesize + mi.oobsize, pageoff);
+	if (ret == 0)
+		return 0;
+	// only fall back if nothing can have been programmed
+	if (errno == ENOTTY || errno == EOPNOTSUPP) {
+		DBG("no MEMWRITE, falling back to write + MEMWRITEOOB\n");
+		return 1;
+	}
+	perror("MEMWRITE");
+	return -errno;
+#else
+	return 1;
+#endif
+}
+
+/*
+ * OOB of one page with the 64-bit offset ioctl, or the 32-bit one where
+ * that is all there is.
+ */
+static int oob_io(int write, long long pageoff, unsigned char *buf)
+{
+	struct mtd_oob_buf oob;
+
+#ifdef MEMWRITEOOB64
+	struct mtd_oob_buf64 oob64;
+
+	memset(&oob64, 0, sizeof(oob64));
+	oob64.start = pageoff;
+	oob64.length = mi.oobsize;
+	oob64.usr_ptr = (unsigned long)buf;
+	if (ioctl(mtd_fd, write ? MEMWRITEOOB64 : MEMREADOOB64, &oob64) == 0)
+		return 0;
+	if (errno != ENOTTY || pageoff > 0xffffffffLL)
+		return -1;
+#endif
+	oob.start = pageoff;
+	oob.length = mi.oobsize;
+	oob.ptr = buf;
+	return ioctl(mtd_fd, write ? MEMWRITEOOB : MEMREADOOB, &oob);
+}
+
+static int mtd_write_raw(long long pageoff, const unsigned char *raw)
+{
+	int ret;
+	STATS_VAR(t0);
+
+	if (use_memwrite) {
+		ret = write_raw_memwrite(pageoff, raw);
+		if (ret <= 0)
+			return ret;
+		use_memwrite = 0;
+	}
+
+	if (lseek(mtd_fd, pageoff, SEEK_SET) != pageoff) {
+		perror("Write seek");
+		return -errno;
+	}
+
+	STATS_BEGIN(t0);
+	ret = write(mtd_fd, raw, mi.writesize);
+	STATS_END(STAT_WRITE_DATA, t0, mi.writesize, pageoff);
+	if (ret != mi.writesize) {
+		perror("Write page");
+		return ret < 0 ? -errno : -EIO;
+	}
+
+	DBG("OOB\n");
+	STATS_BEGIN(t0);
+	ret = oob_io(1, pageoff, (unsigned char *)raw + mi.writesize);
+	STATS_END(STAT_WRITE_OOB, t0, mi.oobsize, pageoff);
+	if (ret != 0) {
+		perror("Write OOB");
+		return -errno;
+	}
+	return 0;
+}
+
+/* Make run_data and run_oob big enough for npages. Returns 0 or -1. */
+static int run_bufs(int npages)
+{
+	if (npages <= run_pages)
+		return 0;
+	free(run_data);
+	free(run_oob);
+	run_data = malloc(npages * mi.writesize);
+	run_oob = malloc(npages * mi.oobsize);
+	if (!run_data || !run_oob) {
+		ERR("malloc failed\n");
+		run_pages = 0;
+		return -1;
+	}
+	run_pages = npages;
+	return 0;
+}
+
+/*
+ * One MEMWRITE for the whole run: the kernel takes data and OOB as two
+ * separate buffers and steps through the OOB one page at a time, so split
+ * the records into those first. Same return as write_raw_memwrite().
+ */
+static int write_run_memwrite(long long off, const unsigned char *raw, int npages)
+{
+#ifdef MEMWRITE
+	struct mtd_write_req req;
+	int raw_sz = mi.writesize + mi.oobsize;
+	int i, ret;
+	STATS_VAR(t0);
+
+	if (run_bufs(npages) < 0)
+		return -ENOMEM;
+
+	for (i = 0; i < npages; i++) {
+		memcpy(run_data + i * mi.writesize, raw + i * raw_sz, mi.writesize);
+		memcpy(run_oob + i * mi.oobsize, raw + i * raw_sz + mi.writesize,
+				mi.oobsize);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.start = off;
+	req.len = npages * mi.writesize;
+	req.ooblen = npages * mi.oobsize;
+	req.usr_data = (unsigned long)run_data;
+	req.usr_oob = (unsigned long)run_oob;
+	req.mode = MTD_OPS_RAW;
+
+	STATS_BEGIN(t0);
+	ret = ioctl(mtd_fd, MEMWRITE, &req);
+	STATS_END(STAT_MEMWRITE, t0, npages * raw_sz, off);
+	if (ret == 0)
+		return 0;
+	if (errno == ENOTTY || errno == EOPNOTSUPP) {
+		DBG("no MEMWRITE, falling back to write + MEMWRITEOOB\n");
+		return 1;
+	}
+	perror("MEMWRITE");
+	return -errno;
+#else
+	return 1;
+#endif
+}
+
+/*
+ * mtdchar does not say how far a failed MEMWRITE got, so *done is 0 then.
+ * Without MEMWRITE the pages go one at a time.
+ */
+static int mtd_write_raw_run(long long off, const unsigned char *raw, int npages,
+		int *done)
+{
+	int raw_sz = mi.writesize + mi.oobsize;
+	int ret;
+
+	*done = 0;
+	if (use_memwrite) {
+		ret = write_run_memwrite(off, raw, npages);
+		if (ret <= 0) {
+			if (ret == 0)
+				*done = npages;
+			return ret;
+		}
+		use_memwrite = 0;
+	}
+
+	for (; *done < npages; ++*done) {
+		ret = mtd_write_raw(off + *done * mi.writesize, raw + *done * raw_sz);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Read in-band data and OOB of a page without ECC correction into raw,
+ * with MEMREAD or else read() + MEMREADOOB. The read() fallback is only
+ * uncorrected if the device was opened with MTDDEV_RAW.
+ */
+static int mtd_read_raw(long long pageoff, unsigned char *raw)
+{
+	ssize_t ret;
+
+#ifdef MEMREAD
+	if (use_memread) {
+		struct mtd_read_req req;
+
+		memset(&req, 0, sizeof(req));
+		req.start = pageoff;
+		req.len = mi.writesize;
+		req.ooblen = mi.oobsize;
+		req.usr_data = (unsigned long)raw;
+		req.usr_oob = (unsigned long)(raw + mi.writesize);
+		req.mode = MTD_OPS_RAW;
+
+		if (ioctl(mtd_fd, MEMREAD, &req) == 0)
+			return 0;
+		if (errno != ENOTTY && errno != EOPNOTSUPP) {
+			perror("MEMREAD");
+			return -errno;
+		}
+		use_memread = 0;
+	}
+#endif
+
+	ret = pread(mtd_fd, raw, mi.writesize, pageoff);
+	if (ret != mi.writesize) {
+		perror("Read page");
+		return ret < 0 ? -errno : -EIO;
+	}
+
+	if (oob_io(0, pageoff, raw + mi.writesize) != 0) {
+		perror("Read OOB");
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * One MEMREAD for the whole run, the reverse of write_run_memwrite():
+ * data and OOB come back separately and are interleaved into records.
+ * Returns 0, -errno, or 1 if there is no MEMREAD.
+ */
+static int read_run_memread(long long off, unsigned char *raw, int npages)
+{
+#ifdef MEMREAD
+	struct mtd_read_req req;
+	int raw_sz = mi.writesize + mi.oobsize;
+	int i;
+
+	if (run_bufs(npages) < 0)
+		return -ENOMEM;
+
+	memset(&req, 0, sizeof(req));
+	req.start = off;
+	req.len = npages * mi.writesize;
+	req.ooblen = npages * mi.oobsize;
+	req.usr_data = (unsigned long)run_data;
+	req.usr_oob = (unsigned long)run_oob;
+	req.mode = MTD_OPS_RAW;
+
+	if (ioctl(mtd_fd, MEMREAD, &req) != 0) {
+		if (errno == ENOTTY || errno == EOPNOTSUPP) {
+			DBG("no MEMREAD, falling back to read + MEMREADOOB\n");
+			return 1;
+		}
+		perror("MEMREAD");
+		return -errno;
+	}
+
+	for (i = 0; i < npages; i++) {
+		memcpy(raw + i * raw_sz, run_data + i * mi.writesize, mi.writesize);
+		memcpy(raw + i * raw_sz + mi.writesize, run_oob + i * mi.oobsize,
+				mi.oobsize);
+	}
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+static int mtd_read_raw_run(long long off, unsigned char *raw, int npages)
+{
+	int raw_sz = mi.writesize + mi.oobsize;
+	int i, ret;
+
+	if (use_memread) {
+		ret = read_run_memread(off, raw, npages);
+		if (ret <= 0)
+			return ret;
+		use_memread = 0;
+	}
+
+	for (i = 0; i < npages; i++) {
+		ret = mtd_read_raw(off + i * mi.writesize, raw + i * raw_sz);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static void mtd_close(void)
+{
+	close(mtd_fd);
+	mtd_fd = -1;
+	free(run_data);
+	free(run_oob);
+	run_data = run_oob = NULL;
+	run_pages = 0;
+}
+
+static const struct flashdev mtd_dev = {
+	.size		= mtd_size,
+	.erase		= mtd_erase,
+	.is_bad		= mtd_is_bad,
+	.mark_bad	= mtd_mark_bad,
+	.write		= mtd_write,
+	.read		= mtd_read,
+	.write_raw	= mtd_write_raw,
+	.read_raw	= mtd_read_raw,
+	.write_raw_run = mtd_write_raw_run,
+	.read_raw_run = mtd_read_raw_run,
+	.close		= mtd_close,
+};
+
+/*
+ * MEMGETINFO's size is 32-bit. The 64-bit size is in sysfs, found through
+ * the char device number; fall back to mi.size if that is not mounted.
+ */
+static long long sysfs_size(void)
+{
+	char path[64];
+	struct stat st;
+	long long size;
+	FILE *f;
+
+	if (fstat(mtd_fd, &st) != 0 || !S_ISCHR(st.st_mode))
+		return mi.size;
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/size",
+			major(st.st_rdev), minor(st.st_rdev));
+	f = fopen(path, "r");
+	if (!f)
+		return mi.size;
+	if (fscanf(f, "%lld", &size) != 1 || size < mi.size)
+		size = mi.size;
+	fclose(f);
+	DBG("%s: %lld\n", path, size);
+	return size;
+}
+
+/* Open an MTD char device and fill in *info. NULL on error. */
+const struct flashdev *mtddev_open(const char *path, int flags,
+		struct mtd_info_user *info)
+{
+	if ((mtd_fd = open(path, flags & MTDDEV_RDONLY ? O_RDONLY : O_RDWR))
+			== -1) {
+		perror(path);
+		return NULL;
+	}
+
+	if (ioctl(mtd_fd, MEMGETINFO, &mi) != 0) {
+		perror("MEMGETINFO");
+		mtd_close();
+		return NULL;
+	}
+
+	dev_size = sysfs_size();
+
+	if (flags & MTDDEV_RAW) {
+		if (ioctl(mtd_fd, MTDFILEMODE, (void *) MTD_MODE_RAW) != 0) {
+			perror ("MTDFILEMODE");
+			mtd_close();
+			return NULL;
+		}
+		DBG("Set MTD_MODE_RAW\n");
+	}
+	if (flags & MTDDEV_NO_MEMWRITE)
+		use_memwrite = 0;
+
+	*info = mi;
+	return &mtd_dev;
+}
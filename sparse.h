@@ -0,0 +1,37 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+/*
+ * Sparse image format, written by mksparse and read with --sparse.
+ * A header, then chunks of whole pages. Data chunks carry their pages;
+ * don't care chunks carry nothing, their pages were all FF and are left
+ * unprogrammed. All fields little-endian.
+ *
+ *   header:	"FTSPARSE", u32 version, u32 page size, u64 image length
+ *   chunk:		u32 type, u32 pages, then pages * page size bytes if data
+ *
+ * The page size includes OOB for raw images. A partial last page is stored
+ * padded with FF to a whole page.
+ */
+#define SPARSE_MAGIC		"FTSPARSE"
+#define SPARSE_VERSION		1
+#define SPARSE_HDR_SIZE		24
+#define SPARSE_CHUNK_SIZE	8
+
+#define SPARSE_DATA			1
+#define SPARSE_DONT_CARE	2
+
+static inline unsigned int sparse_get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline void sparse_put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+#endif // SPARSE_H
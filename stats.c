@@ -0,0 +1,216 @@
+/*
+ * Run timing for --stats: monotonic clock around the hot paths, kept as
+ * per operation totals and log-linear latency histograms, written out as
+ * JSON at exit. Updates are lock-free atomics, the ECC workers and bad
+ * block scan threads time themselves.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifdef HAVE_STATS
+
+#include <stdio.h>
+#include <string.h>
+
+#include "monotime.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * Histogram buckets: exact below 8 ns, then 8 per power of two, so a
+ * percentile is within 12.5% whatever the scale.
+ */
+#define HIST_SUB_BITS	3
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define MAX_COUNTERS	32
+
+struct op_stats {
+	unsigned long long	count;
+	unsigned long long	total_ns;
+	unsigned long long	max_ns;
+	long long			bytes;
+	unsigned int		hist[HIST_BUCKETS];
+};
+
+static const char *const op_names[STAT_OPS] = {
+	[STAT_ERASE]		= "erase",
+	[STAT_PROGRAM]		= "program",
+	[STAT_WRITE]		= "write",
+	[STAT_MEMWRITE]		= "memwrite",
+	[STAT_WRITE_DATA]	= "write_data",
+	[STAT_WRITE_OOB]	= "write_oob",
+	[STAT_READ]			= "read",
+	[STAT_ECC]			= "ecc",
+	[STAT_ECC_WAIT]		= "ecc_wait",
+	[STAT_IMAGE]		= "image",
+	[STAT_INPUT]		= "input",
+	[STAT_BAD_CHECK]	= "bad_check",
+};
+
+int stats_on;
+
+static struct op_stats	ops[STAT_OPS];
+static unsigned long long start_ns;
+static const char		*counter_names[MAX_COUNTERS];
+static long long		counter_values[MAX_COUNTERS];
+static int				ncounters;
+
+unsigned long long stats_now(void)
+{
+	return monotime_ns();
+}
+
+/* Start of the run, for the elapsed time and overall rate */
+void stats_start(void)
+{
+	start_ns = stats_now();
+	stats_on = 1;
+}
+
+static int hist_bucket(unsigned long long ns)
+{
+	int msb;
+
+	if (ns < HIST_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Largest value that lands in bucket b */
+static unsigned long long hist_top(int b)
+{
+	int msb, sub;
+
+	if (b < HIST_SUB)
+		return b;
+	msb = b / HIST_SUB + HIST_SUB_BITS - 1;
+	sub = b % HIST_SUB;
+	return ((unsigned long long)(HIST_SUB + sub + 1) <<
+			(msb - HIST_SUB_BITS)) - 1;
+}
+
+/*
+ * One op started at t0 (stats_now()) has finished, moving bytes. With
+ * --trace it goes on the timeline too, at flash offset off or -1. A t0 of 0 is an op begun with
+ * timing off, not counted.
+ */
+void stats_add(enum stats_op op, unsigned long long t0, long long bytes,
+		long long off)
+{
+	struct op_stats *s = &ops[op];
+	unsigned long long t1, ns, max;
+
+	if (!stats_on || !t0)
+		return;
+	t1 = stats_now();
+	ns = t1 - t0;
+
+	if (trace_on)
+		trace_span(op_names[op], t0, t1, off);
+
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->hist[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Set a named count for the summary, name must stay valid */
+void stats_counter(const char *name, long long value)
+{
+	int i;
+
+	for (i = 0; i < ncounters; i++) {
+		if (!strcmp(counter_names[i], name)) {
+			counter_values[i] = value;
+			return;
+		}
+	}
+	if (ncounters < MAX_COUNTERS) {
+		counter_names[ncounters] = name;
+		counter_values[ncounters++] = value;
+	}
+}
+
+/* Latency at fraction q of the op's samples, in ns, capped at the max */
+static unsigned long long percentile(const struct op_stats *s, double q)
+{
+	unsigned long long rank, seen = 0;
+	int b;
+
+	if (!s->count)
+		return 0;
+	rank = q * s->count;
+	if (rank < 1)
+		rank = 1;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += s->hist[b];
+		if (seen >= rank)
+			break;
+	}
+	return hist_top(b) < s->max_ns ? hist_top(b) : s->max_ns;
+}
+
+/*
+ * Write the summary as JSON to path, - for stdout, with bytes the image
+ * bytes done over the whole run. Times are in seconds and microseconds,
+ * an op's bytes_per_s is over the time spent in it. Returns 0 or -1.
+ */
+int stats_dump(const char *path, long long bytes)
+{
+	const struct op_stats *s;
+	double elapsed = (stats_now() - start_ns) / 1e9;
+	FILE *f;
+	int i;
+
+	f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	fprintf(f, "{\n  \"elapsed_s\": %.6f,\n  \"bytes\": %lld,\n"
+			"  \"bytes_per_s\": %.0f,\n  \"ops\": {\n", elapsed, bytes,
+			elapsed > 0 ? bytes / elapsed : 0.0);
+	for (i = 0; i < STAT_OPS; i++) {
+		s = &ops[i];
+		fprintf(f, "    \"%s\": { \"count\": %llu, \"total_s\": %.6f, "
+				"\"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f, "
+				"\"bytes\": %lld, \"bytes_per_s\": %.0f }%s\n",
+				op_names[i], s->count, s->total_ns / 1e9,
+				percentile(s, 0.50) / 1e3, percentile(s, 0.99) / 1e3,
+				s->max_ns / 1e3, s->bytes,
+				s->total_ns ? s->bytes / (s->total_ns / 1e9) : 0.0,
+				i < STAT_OPS - 1 ? "," : "");
+	}
+	fprintf(f, "  },\n  \"counters\": {\n");
+	for (i = 0; i < ncounters; i++)
+		fprintf(f, "    \"%s\": %lld%s\n", counter_names[i],
+				counter_values[i], i < ncounters - 1 ? "," : "");
+	fprintf(f, "  }\n}\n");
+
+	if (f == stdout)
+		return fflush(f) == 0 ? 0 : -1;
+	if (fclose(f) != 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+#endif // HAVE_STATS
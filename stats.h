@@ -0,0 +1,59 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ * Run timing: per operation counts, time and latency histograms, dumped
+ * as JSON by --stats. Built with -DHAVE_STATS; without it the macros are
+ * empty and nothing is timed. With it, nothing is timed either until
+ * stats_start() or trace_start() turns on stats_on: the macros then cost
+ * a load and a branch.
+ *
+ *	STATS_VAR(t0);					last of the declarations
+ *	STATS_BEGIN(t0);
+ *	ret = dev->erase(off);
+ *	STATS_END(STAT_ERASE, t0, 0, off);
+ *
+ * The last argument is the flash offset the op works on, for --trace, or
+ * -1 for ops not tied to one.
+ */
+enum stats_op {
+	STAT_ERASE,
+	STAT_PROGRAM,		// write_page(), write_page_run()
+	STAT_WRITE,			// MTD: in-band write()
+	STAT_MEMWRITE,		// MTD: data + OOB in one ioctl
+	STAT_WRITE_DATA,	// MTD: raw page data without MEMWRITE
+	STAT_WRITE_OOB,		// MTD: MEMWRITEOOB
+	STAT_READ,			// -r, --verify, --diff device reads
+	STAT_ECC,			// genecc_block(), in the ECC workers
+	STAT_ECC_WAIT,		// writer waiting for a page's ECC
+	STAT_IMAGE,			// next_image_block()
+	STAT_INPUT,			// reader thread filling an image block
+	STAT_BAD_CHECK,		// MEMGETBADBLOCK
+	STAT_OPS
+};
+
+#ifdef HAVE_STATS
+
+extern int stats_on;
+
+void stats_start(void);
+unsigned long long stats_now(void);
+void stats_add(enum stats_op op, unsigned long long t0, long long bytes,
+		long long off);
+void stats_counter(const char *name, long long value);
+int stats_dump(const char *path, long long bytes);
+
+#  define STATS_VAR(t)				unsigned long long t
+#  define STATS_BEGIN(t)			((t) = stats_on ? stats_now() : 0)
+#  define STATS_END(op, t, bytes, off) \
+	do { if (stats_on) stats_add(op, t, bytes, off); } while (0)
+
+#else
+
+#  define STATS_VAR(t)
+#  define STATS_BEGIN(t)			((void)0)
+#  define STATS_END(op, t, bytes, off)	((void)0)
+
+#endif // HAVE_STATS
+
+#endif // STATS_H
@@ -0,0 +1,211 @@
+/*
+ * Run timeline for --trace. Each thread appends to its own ring, so
+ * recording an event is a few stores and one release of the ring head,
+ * without locks or shared cache lines. The rings are read once, at exit.
+ *
+ * Copyright (C) 2011 Racelogic Limited
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifdef HAVE_STATS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#define TRACE_INSTANT	(~0ULL)		// dur of a trace_mark() event
+
+struct trace_event {
+	unsigned long long	ts;			// stats_now() ns
+	unsigned long long	dur;		// ns, or TRACE_INSTANT
+	const char			*name;
+	long long			off;		// flash offset, or -1
+};
+
+struct trace_ring {
+	const char			*name;
+	unsigned long long	head;		// events ever recorded
+	struct trace_event	*ev;
+};
+
+int trace_on;
+
+static struct trace_ring	rings[TRACE_THREADS];
+static int					nrings;
+static unsigned long long	start_ns;
+static unsigned int			ring_events;	// per ring, a power of two
+static __thread struct trace_ring *my_ring;
+static __thread int			no_ring;	// out of rings or memory
+
+/*
+ * Give the calling thread its ring. The ring is allocated and every page of
+ * it written here, as the thread starts, so neither malloc() nor the page
+ * faults land in the timeline. Returns NULL when out of
+ * rings or memory; the thread then records nothing.
+ */
+static struct trace_ring *new_ring(void)
+{
+	size_t size = ring_events * sizeof(struct trace_event);
+	long pagesz = sysconf(_SC_PAGESIZE);
+	struct trace_event *ev;
+	volatile char *p;
+	int i;
+
+	if (my_ring || no_ring)
+		return my_ring;
+
+	no_ring = 1;
+	i = __atomic_fetch_add(&nrings, 1, __ATOMIC_RELAXED);
+	if (i >= TRACE_THREADS)
+		return NULL;
+	ev = malloc(size);
+	if (!ev)
+		return NULL;
+	// not memset(), which may become a calloc() of untouched pages
+	for (p = (volatile char *)ev; p < (volatile char *)ev + size;
+			p += pagesz > 0 ? pagesz : 4096)
+		*p = 0;
+	__atomic_store_n(&rings[i].ev, ev, __ATOMIC_RELEASE);
+	no_ring = 0;
+	my_ring = &rings[i];
+	return my_ring;
+}
+
+/*
+ * Turn tracing on, with the calling (main) thread's ring. events is the
+ * ring size, 0 for TRACE_EVENTS.
+ */
+void trace_start(int events)
+{
+	if (events <= 0)
+		events = TRACE_EVENTS;
+	if (events > TRACE_EVENTS_MAX)
+		events = TRACE_EVENTS_MAX;
+	for (ring_events = 1; ring_events < (unsigned int)events; ring_events <<= 1)
+		;
+	start_ns = stats_now();
+	trace_on = 1;
+	// the spans are the ops timed for --stats
+	stats_on = 1;
+	new_ring();
+}
+
+static void record(const char *name, unsigned long long ts,
+		unsigned long long dur, long long off)
+{
+	struct trace_ring *r = my_ring;
+	struct trace_event *e;
+
+	if (!r)
+		return;
+	e = &r->ev[r->head & (ring_events - 1)];
+	e->ts = ts;
+	e->dur = dur;
+	e->name = name;
+	e->off = off;
+	// the event is complete before the dump can count it
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Set up the calling thread's ring and name it in the trace, name must
+ * stay valid. A thread records events only once it has called this, so
+ * call it first thing.
+ */
+void trace_thread(const char *name)
+{
+	struct trace_ring *r = new_ring();
+
+	if (r)
+		r->name = name;
+}
+
+/* An op from t0 to t1 (stats_now()), at flash offset off or -1 */
+void trace_span(const char *name, unsigned long long t0,
+		unsigned long long t1, long long off)
+{
+	record(name, t0, t1 - t0, off);
+}
+
+/* A point event now, e.g. a bad block decision at off */
+void trace_mark(const char *name, long long off)
+{
+	record(name, stats_now(), TRACE_INSTANT, off);
+}
+
+static void put_event(FILE *f, int tid, const struct trace_event *e)
+{
+	double ts = e->ts > start_ns ? (e->ts - start_ns) / 1e3 : 0;
+
+	if (e->dur == TRACE_INSTANT)
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+				"\"pid\":1,\"tid\":%d", e->name, ts, tid);
+	else
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+				"\"dur\":%.3f,\"pid\":1,\"tid\":%d", e->name, ts,
+				e->dur / 1e3, tid);
+	if (e->off >= 0)
+		fprintf(f, ",\"args\":{\"off\":\"0x%llx\"}", e->off);
+	fputs("}", f);
+}
+
+/*
+ * Write the rings to path as Chrome trace JSON, threads named, times in
+ * us from trace_start(). Returns 0 or -1.
+ */
+int trace_dump(const char *path)
+{
+	const struct trace_ring *r;
+	unsigned long long head, i, first, dropped = 0;
+	FILE *f;
+	int n, tid;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"args\":{\"name\":\"flashtool\"}}", f);
+
+	n = __atomic_load_n(&nrings, __ATOMIC_RELAXED);
+	if (n > TRACE_THREADS)
+		n = TRACE_THREADS;
+	for (tid = 0; tid < n; tid++) {
+		r = &rings[tid];
+		if (!__atomic_load_n(&r->ev, __ATOMIC_ACQUIRE))
+			continue;
+		if (r->name)
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+					"\"tid\":%d,\"args\":{\"name\":\"%s\"}}", tid, r->name);
+
+		// a thread still running may overwrite the oldest meanwhile
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		first = head > ring_events ? head - ring_events : 0;
+		dropped += first;
+		for (i = first; i < head; i++)
+			put_event(f, tid, &r->ev[i & (ring_events - 1)]);
+	}
+	fprintf(f, "\n],\"otherData\":{\"dropped_events\":%llu}}\n", dropped);
+
+	if (fclose(f) != 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+#endif // HAVE_STATS
@@ -0,0 +1,44 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Run timeline for --trace: every op timed for --stats (see stats.h) is
+ * also recorded as an event with its thread, plus named instants for
+ * decisions such as bad blocks. Written at exit as Chrome trace JSON, for
+ * Perfetto or chrome://tracing. Built with -DHAVE_STATS, as --stats is.
+ *
+ * Each thread records into its own ring of events, TRACE_EVENTS (512 KiB)
+ * unless trace_start() is given another count, rounded up to a power of
+ * two. It is allocated and touched up front by TRACE_THREAD() as the
+ * thread starts and by trace_start() for the main thread; a thread that
+ * has not called it records nothing. When a ring is full its oldest events
+ * are dropped. Every traced thread (main, reader or writer, scan threads,
+ * an ECC worker per CPU) has a ring, so keep the count modest on small
+ * boards.
+ */
+#define TRACE_EVENTS		(1 << 14)
+#define TRACE_EVENTS_MAX	(1 << 22)
+#define TRACE_THREADS	64
+
+#ifdef HAVE_STATS
+
+extern int trace_on;
+
+void trace_start(int events);
+void trace_thread(const char *name);
+void trace_span(const char *name, unsigned long long t0,
+		unsigned long long t1, long long off);
+void trace_mark(const char *name, long long off);
+int trace_dump(const char *path);
+
+#  define TRACE_THREAD(name)		do { if (trace_on) trace_thread(name); } while (0)
+#  define TRACE_MARK(name, off)		do { if (trace_on) trace_mark(name, off); } while (0)
+
+#else
+
+#  define TRACE_THREAD(name)		((void)0)
+#  define TRACE_MARK(name, off)		((void)0)
+
+#endif // HAVE_STATS
+
+#endif // TRACE_H